@@ -0,0 +1,197 @@
+/*
+ * Host benchmark of the SSE client enqueue protocol: the latency of posting an event to a client whose
+ * lock the network task holds, waiting for the lock against handing the event over with AsyncMpscQueue.
+ *
+ *   g++ -O2 -std=gnu++17 -pthread -o handoff_bench extras/bench/handoff_bench.cpp && ./handoff_bench
+ *
+ * The client is modeled on AsyncEventSourceClient: a lock, a queue of shared events, and the handoff queue
+ * with the same post (try_lock, else push) and drain (fence, then try_lock) steps as _post() and _drainPending().
+ * The network task keeps the lock while it writes the queue to the socket, and once in a while is preempted
+ * while holding it, the case where a poster waiting for the lock stalls. Every post is timed, and every event
+ * is checked to be queued exactly once, in order per poster.
+ */
+#include "../../src/AsyncMpscQueue.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+typedef std::chrono::steady_clock Clock;
+
+// as SSE_MAX_QUEUED_MESSAGES and SSE_CLIENT_HANDOFF_SIZE
+static constexpr size_t QUEUE_SIZE = 32;
+static constexpr size_t HANDOFF_SIZE = 16;
+
+// the network task writes the queue for this long while holding the lock
+static constexpr auto WRITE_TIME = std::chrono::microseconds(5);
+// and is preempted for this long with the lock held, once every PREEMPT_EVERY writes
+static constexpr auto PREEMPT_TIME = std::chrono::microseconds(300);
+static constexpr int PREEMPT_EVERY = 256;
+// and then waits for the next acknowledgement
+static constexpr auto ACK_INTERVAL = std::chrono::microseconds(50);
+
+static constexpr int POSTS = 10000;
+static constexpr auto POST_INTERVAL = std::chrono::microseconds(100);
+
+struct Event {
+    std::shared_ptr<const std::string> data;
+    uint32_t seq{0};
+};
+
+struct Client {
+    std::mutex lock;
+    Event queue[QUEUE_SIZE];
+    size_t head{0};
+    size_t len{0};
+    AsyncMpscQueue<Event, HANDOFF_SIZE> pending;
+    // checks, only touched with the lock held
+    std::vector<uint32_t> last;
+    size_t queued{0};
+    size_t dropped{0};
+    size_t outOfOrder{0};
+
+    explicit Client(int posters) : last(posters, 0) {}
+
+    void enqueue(Event&& e) {
+      // lock must be held by the caller
+      uint32_t poster = e.seq >> 24, seq = e.seq & 0xffffff;
+      if (seq != last[poster] + 1)
+        ++outOfOrder;
+      last[poster] = seq;
+      if (len == QUEUE_SIZE) {
+        ++dropped;
+        return;
+      }
+      queue[(head + len++) % QUEUE_SIZE] = std::move(e);
+      ++queued;
+    }
+
+    void takePending() {
+      // lock must be held by the caller
+      if (!pending.pending())
+        return;
+      pending.drain([this](Event& e) { enqueue(std::move(e)); });
+    }
+
+    void drainPending() {
+      for (;;) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!pending.pending() || !lock.try_lock())
+          return;
+        takePending();
+        lock.unlock();
+      }
+    }
+};
+
+struct Counters {
+    std::atomic<size_t> handedOver{0};
+    std::atomic<size_t> waited{0};
+};
+
+static void postLocked(Client& c, Event&& e, Counters&) {
+  std::lock_guard<std::mutex> guard(c.lock);
+  c.enqueue(std::move(e));
+}
+
+static void postHandoff(Client& c, Event&& e, Counters& n) {
+  if (c.lock.try_lock()) {
+    c.takePending();
+    c.enqueue(std::move(e));
+    c.lock.unlock();
+    c.drainPending();
+    return;
+  }
+  if (c.pending.push(std::move(e))) {
+    ++n.handedOver;
+    c.drainPending();
+    return;
+  }
+  // the handoff is full, wait for the lock as _queueMessage() does, behind the events handed over
+  ++n.waited;
+  {
+    std::lock_guard<std::mutex> guard(c.lock);
+    c.takePending();
+    c.enqueue(std::move(e));
+  }
+  c.drainPending();
+}
+
+static void spin(Clock::duration d) {
+  const auto start = Clock::now();
+  while (Clock::now() - start < d) {
+  }
+}
+
+template <typename Post>
+static void run(const char* name, Post post, int posters) {
+  Client client(posters);
+  Counters counters;
+  std::atomic<bool> stop{false};
+
+  std::thread network([&] {
+    for (int i = 0; !stop.load(std::memory_order_relaxed); i++) {
+      {
+        std::lock_guard<std::mutex> guard(client.lock);
+        client.takePending();
+        spin(WRITE_TIME);
+        if (i % PREEMPT_EVERY == 0)
+          std::this_thread::sleep_for(PREEMPT_TIME);
+        while (client.len) {
+          client.queue[client.head] = Event();
+          client.head = (client.head + 1) % QUEUE_SIZE;
+          --client.len;
+        }
+      }
+      client.drainPending();
+      std::this_thread::sleep_for(ACK_INTERVAL);
+    }
+  });
+
+  auto data = std::make_shared<const std::string>("event: e\ndata: 42\n\n");
+  std::vector<std::vector<uint32_t>> latency(posters);
+  std::vector<std::thread> threads;
+  for (int p = 0; p < posters; p++)
+    threads.emplace_back([&, p] {
+      latency[p].reserve(POSTS);
+      for (uint32_t seq = 1; seq <= POSTS; seq++) {
+        const auto start = Clock::now();
+        post(client, Event{data, (uint32_t)p << 24 | seq}, counters);
+        latency[p].push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count());
+        // posters sleep between events, which lets the network task run on a single core as well
+        std::this_thread::sleep_for(POST_INTERVAL);
+      }
+    });
+  for (auto& t : threads)
+    t.join();
+  stop = true;
+  network.join();
+
+  std::lock_guard<std::mutex> guard(client.lock);
+  client.takePending();
+  std::vector<uint32_t> all;
+  for (auto& l : latency)
+    all.insert(all.end(), l.begin(), l.end());
+  std::sort(all.begin(), all.end());
+  const size_t total = all.size();
+  const bool complete = client.queued + client.dropped == total && !client.outOfOrder;
+  printf(
+    "%-8s posters %d: p50 %6u p99 %6u p99.9 %6u max %7u ns, handed over %5zu, waited %3zu, dropped %zu%s\n", name, posters, all[total / 2], all[total * 99 / 100],
+    all[total * 999 / 1000], all.back(), counters.handedOver.load(), counters.waited.load(), client.dropped, complete ? "" : ", EVENTS LOST OR REORDERED"
+  );
+}
+
+int main() {
+  printf("%u hardware threads\n", std::thread::hardware_concurrency());
+  for (int posters : {1, 2, 4}) {
+    run("lock", postLocked, posters);
+    run("handoff", postHandoff, posters);
+  }
+  return 0;
+}
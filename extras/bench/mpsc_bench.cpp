@@ -0,0 +1,126 @@
+/*
+ * Host benchmark of AsyncMpscQueue (src/AsyncMpscQueue.h), the queue behind post() and the SSE client handoff:
+ * the latency of a push while a consumer drains, against a ring of the same size behind a mutex.
+ *
+ *   g++ -O2 -std=gnu++17 -pthread -o mpsc_bench extras/bench/mpsc_bench.cpp && ./mpsc_bench
+ *
+ * Items hold a shared buffer like posted messages do. A push finding the queue full is retried after a yield
+ * and counted, only successful pushes are timed. The consumer checks that every item arrives once, in order per producer.
+ */
+#include "../../src/AsyncMpscQueue.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+typedef std::chrono::steady_clock Clock;
+
+// as SSE_POST_QUEUE_SIZE and WS_POST_QUEUE_SIZE on ESP32
+static constexpr size_t QUEUE_SIZE = 16;
+static constexpr uint32_t PUSHES = 50000;
+
+struct Item {
+    std::shared_ptr<const int> data;
+    uint32_t seq{0};
+};
+
+// the same interface, a ring protected by a mutex
+class LockedQueue {
+  private:
+    std::mutex _lock;
+    Item _items[QUEUE_SIZE];
+    size_t _head{0};
+    size_t _len{0};
+
+  public:
+    bool push(Item&& item) {
+      std::lock_guard<std::mutex> guard(_lock);
+      if (_len == QUEUE_SIZE)
+        return false;
+      _items[(_head + _len++) % QUEUE_SIZE] = std::move(item);
+      return true;
+    }
+
+    template <typename F>
+    size_t drain(F&& f) {
+      std::lock_guard<std::mutex> guard(_lock);
+      size_t count = 0;
+      for (; _len; --_len, ++count) {
+        Item item = std::move(_items[_head]);
+        _head = (_head + 1) % QUEUE_SIZE;
+        f(item);
+      }
+      return count;
+    }
+};
+
+template <typename Queue>
+static void run(const char* name, int producers) {
+  Queue queue;
+  std::atomic<int> running{producers};
+  std::vector<uint32_t> last(producers, 0);
+  size_t received = 0, outOfOrder = 0;
+
+  std::thread consumer([&] {
+    auto take = [&](Item& item) {
+      uint32_t producer = item.seq >> 24, seq = item.seq & 0xffffff;
+      if (seq != last[producer] + 1)
+        ++outOfOrder;
+      last[producer] = seq;
+      ++received;
+    };
+    while (running.load(std::memory_order_acquire))
+      if (!queue.drain(take))
+        std::this_thread::yield();
+    queue.drain(take);
+  });
+
+  auto data = std::make_shared<const int>(42);
+  std::atomic<size_t> full{0};
+  std::vector<std::vector<uint32_t>> latency(producers);
+  std::vector<std::thread> threads;
+  for (int p = 0; p < producers; p++)
+    threads.emplace_back([&, p] {
+      latency[p].reserve(PUSHES);
+      for (uint32_t seq = 1; seq <= PUSHES; seq++)
+        for (;;) {
+          const auto start = Clock::now();
+          const bool pushed = queue.push(Item{data, (uint32_t)p << 24 | seq});
+          const auto end = Clock::now();
+          if (pushed) {
+            latency[p].push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+            break;
+          }
+          ++full;
+          std::this_thread::yield();
+        }
+      running.fetch_sub(1, std::memory_order_release);
+    });
+  for (auto& t : threads)
+    t.join();
+  consumer.join();
+
+  std::vector<uint32_t> all;
+  for (auto& l : latency)
+    all.insert(all.end(), l.begin(), l.end());
+  std::sort(all.begin(), all.end());
+  const size_t total = all.size();
+  printf(
+    "%-6s producers %d: p50 %5u p99 %6u p99.9 %7u max %8u ns, full %6zu%s\n", name, producers, all[total / 2], all[total * 99 / 100], all[total * 999 / 1000],
+    all.back(), full.load(), received == total && !outOfOrder ? "" : ", ITEMS LOST OR REORDERED"
+  );
+}
+
+int main() {
+  printf("%u hardware threads\n", std::thread::hardware_concurrency());
+  for (int producers : {1, 2, 4, 8}) {
+    run<AsyncMpscQueue<Item, QUEUE_SIZE>>("mpsc", producers);
+    run<LockedQueue>("mutex", producers);
+  }
+  return 0;
+}
@@ -24,88 +24,133 @@
 #include "AsyncEventSource.h"
 
 #define ASYNC_SSE_NEW_LINE_CHAR (char)0xa
+// in-flight window growth for each window of data acknowledged in time, one MSS
+#define SSE_INFLIGH_STEP 1460
+// an ack is late when it takes more than twice the usual time plus this many ms
+#define SSE_ACK_SLACK_MS 10
 
 using namespace asyncsrv;
 
-static String generateEventMessage(const char* message, const char* event, uint32_t id, uint32_t reconnect) {
-  String str;
-  size_t len{0};
-  if (message)
-    len += strlen(message);
+// number of decimal digits of value
+static size_t decimalLength(uint32_t value) {
+  size_t len = 1;
+  while (value >= 10) {
+    value /= 10;
+    ++len;
+  }
+  return len;
+}
 
-  if (event)
-    len += strlen(event);
+// bytes of message without its line breaks, and its number of lines
+static size_t eventDataLength(const char* message, size_t& lines) {
+  size_t len = 0;
+  lines = 0;
+  bool lineOpen = false;
+  for (const char* p = message; *p; ++p) {
+    if (*p == '\n' || *p == '\r') {
+      // \r\n ends a single line
+      if (!(*p == '\n' && p > message && p[-1] == '\r'))
+        ++lines;
+      lineOpen = false;
+    } else {
+      ++len;
+      lineOpen = true;
+    }
+  }
+  if (lineOpen)
+    ++lines;
+  return len;
+}
+
+static AsyncEvent_SharedData_t generateEventMessage(const char* message, const char* event, uint32_t id, uint32_t reconnect) {
+  size_t lines = 0;
+  size_t len = message ? eventDataLength(message, lines) : 0;
+  // an event without a data line is never dispatched by clients, an empty message gets an empty one
+  const bool empty = message && !lines;
+  AsyncEventSourceEvent str(event, id, reconnect, len, empty ? 1 : lines);
+  if (empty)
+    str.write((uint8_t)ASYNC_SSE_NEW_LINE_CHAR);
+  else if (message)
+    str.write(message);
+  return str.message();
+}
 
-  len += 42; // give it some overhead
+// Event
 
-  str.reserve(len);
+AsyncEventSourceEvent::AsyncEventSourceEvent(const char* event, uint32_t id, uint32_t reconnect, size_t dataLen, size_t dataLines)
+    : _id(id) {
+  // size it exactly, so that the text is written in a single allocation
+  size_t len = dataLen + dataLines * (strlen(T_data_) + 1) + 1;
+  if (reconnect)
+    len += strlen(T_retry_) + decimalLength(reconnect) + 1;
+  if (id)
+    len += strlen(T_id__) + decimalLength(id) + 1;
+  if (event)
+    len += strlen(T_event_) + strlen(event) + 1;
+  _str.reserve(len);
 
   if (reconnect) {
-    str += T_retry_;
-    str += reconnect;
-    str += ASYNC_SSE_NEW_LINE_CHAR; // '\n'
+    _str += T_retry_;
+    _str += reconnect;
+    _str += ASYNC_SSE_NEW_LINE_CHAR; // '\n'
   }
 
   if (id) {
-    str += T_id__;
-    str += id;
-    str += ASYNC_SSE_NEW_LINE_CHAR; // '\n'
+    _str += T_id__;
+    _str += id;
+    _str += ASYNC_SSE_NEW_LINE_CHAR; // '\n'
   }
 
   if (event != NULL) {
-    str += T_event_;
-    str += event;
-    str += ASYNC_SSE_NEW_LINE_CHAR; // '\n'
+    _str += T_event_;
+    _str += event;
+    _str += ASYNC_SSE_NEW_LINE_CHAR; // '\n'
   }
+}
 
-  if (!message)
-    return str;
-
-  size_t messageLen = strlen(message);
-  char* lineStart = (char*)message;
-  char* lineEnd;
-  do {
-    char* nextN = strchr(lineStart, '\n');
-    char* nextR = strchr(lineStart, '\r');
-    if (nextN == NULL && nextR == NULL) {
-      // a message is a single-line string
-      str += T_data_;
-      str += message;
-      str += T_nn;
-      return str;
-    }
+size_t AsyncEventSourceEvent::write(uint8_t c) {
+  return write(&c, 1);
+}
 
-    // a message is a multi-line string
-    char* nextLine = NULL;
-    if (nextN != NULL && nextR != NULL) { // windows line-ending \r\n
-      if (nextR + 1 == nextN) {
-        // normal \r\n sequense
-        lineEnd = nextR;
-        nextLine = nextN + 1;
-      } else {
-        // some abnormal \n \r mixed sequence
-        lineEnd = std::min(nextR, nextN);
-        nextLine = lineEnd + 1;
+size_t AsyncEventSourceEvent::write(const uint8_t* buffer, size_t size) {
+  const char* data = (const char*)buffer;
+  const char* end = data + size;
+  while (data < end) {
+    if (*data == '\n' || *data == '\r') {
+      // \r\n ends a single line
+      if (!(*data == '\n' && _cr)) {
+        if (!_lineOpen)
+          _str += T_data_;
+        _str += ASYNC_SSE_NEW_LINE_CHAR; // \n
+        _lineOpen = false;
       }
-    } else if (nextN != NULL) { // Unix/Mac OS X LF
-      lineEnd = nextN;
-      nextLine = nextN + 1;
-    } else { // some ancient garbage
-      lineEnd = nextR;
-      nextLine = nextR + 1;
+      _cr = *data == '\r';
+      ++data;
+      continue;
     }
 
-    str += T_data_;
-    str.concat(lineStart, lineEnd - lineStart);
-    str += ASYNC_SSE_NEW_LINE_CHAR; // \n
-
-    lineStart = nextLine;
-  } while (lineStart < ((char*)message + messageLen));
+    // copy the rest of the line at once
+    const char* lineEnd = data;
+    while (lineEnd < end && *lineEnd != '\n' && *lineEnd != '\r')
+      ++lineEnd;
+    if (!_lineOpen) {
+      _str += T_data_;
+      _lineOpen = true;
+    }
+    _str.concat(data, lineEnd - data);
+    _cr = false;
+    data = lineEnd;
+  }
+  return size;
+}
 
+AsyncEvent_SharedData_t AsyncEventSourceEvent::message() {
+  if (_lineOpen)
+    _str += ASYNC_SSE_NEW_LINE_CHAR; // \n
+  _lineOpen = false;
   // append another \n to terminate message
-  str += ASYNC_SSE_NEW_LINE_CHAR; // '\n'
-
-  return str;
+  _str += ASYNC_SSE_NEW_LINE_CHAR; // '\n'
+  return std::make_shared<String>(std::move(_str));
 }
 
 // Message
@@ -158,6 +203,14 @@ size_t AsyncEventSourceMessage::send(AsyncClient* client) {
 AsyncEventSourceClient::AsyncEventSourceClient(AsyncWebServerRequest* request, AsyncEventSource* server)
     : _client(request->client()), _server(server) {
 
+  _lastWrite = _lastAck = millis();
+
+  for (size_t i = 0; i < request->params(); i++) {
+    const AsyncWebParameter* p = request->getParam(i);
+    if (!p->isPost() && !p->isFile() && p->name() == T_topic && p->value().length() && std::find(_topics.begin(), _topics.end(), p->value()) == _topics.end())
+      _topics.push_back(p->value());
+  }
+
   if (request->hasHeader(T_Last_Event_ID))
     _lastId = atoi(request->getHeader(T_Last_Event_ID)->value().c_str());
 
@@ -176,15 +229,62 @@ AsyncEventSourceClient::AsyncEventSourceClient(AsyncWebServerRequest* request, A
 }
 
 AsyncEventSourceClient::~AsyncEventSourceClient() {
+  AsyncClient* client;
+  {
 #ifdef ESP32
-  std::lock_guard<std::mutex> lock(_lockmq);
+    std::lock_guard<std::mutex> lock(_lockmq);
 #endif
-  _messageQueue.clear();
-  close();
+    client = _client;
+    _client = nullptr;
+  }
+  if (!client)
+    return;
+  // the connection may outlive this object until its disconnect, which then only frees it
+  client->onAck(NULL, NULL);
+  client->onPoll(NULL, NULL);
+  client->onTimeout(NULL, NULL);
+  client->onDisconnect([](void* r __attribute__((unused)), AsyncClient* c) { delete c; }, NULL);
+  client->close();
 }
 
 bool AsyncEventSourceClient::_queueMessage(const char* message, size_t len) {
-  if (_messageQueue.size() >= SSE_MAX_QUEUED_MESSAGES) {
+  // esp8266's String does not have constructor with data/length arguments. Use a concat method here
+  AsyncEvent_SharedData_t msg = std::make_shared<String>();
+  msg->concat(message, len);
+  return _queueMessage(std::move(msg));
+}
+
+bool AsyncEventSourceClient::_queueMessage(AsyncEvent_SharedData_t&& msg, AsyncEvent_SharedData_t key) {
+  bool queued = false;
+  {
+#ifdef ESP32
+    // the queue length is checked under the lock, the ring has no room for one more message
+    std::lock_guard<std::mutex> lock(_lockmq);
+    // events handed over earlier go first
+    _takePending();
+#endif
+    // the connection is only freed on disconnect with the lock released, see _onDisconnect()
+    if (_client && _client->connected())
+      queued = _enqueue(std::move(msg), std::move(key));
+  }
+  _drainPending();
+  return queued;
+}
+
+bool AsyncEventSourceClient::_enqueue(AsyncEvent_SharedData_t&& msg, AsyncEvent_SharedData_t key) {
+  // lock must be held by the caller
+  // a keyed message takes the place of a queued one with the same key that is not being sent yet
+  if (key) {
+    for (size_t i = _mqSent; i < _mqLen; ++i) {
+      AsyncEventSourceMessage& m = _queued(i);
+      if (m.key() && !m.started() && *m.key() == *key) {
+        m = AsyncEventSourceMessage(std::move(msg), std::move(key));
+        return true;
+      }
+    }
+  }
+
+  if (_mqLen >= SSE_MAX_QUEUED_MESSAGES) {
 #ifdef ESP8266
     ets_printf(String(F("ERROR: Too many messages queued\n")).c_str());
 #elif defined(ESP32)
@@ -193,12 +293,9 @@ bool AsyncEventSourceClient::_queueMessage(const char* message, size_t len) {
     return false;
   }
 
-#ifdef ESP32
-  // length() is not thread-safe, thus acquiring the lock before this call..
-  std::lock_guard<std::mutex> lock(_lockmq);
-#endif
-
-  _messageQueue.emplace_back(message, len);
+  if (_mqSent == _mqLen)
+    _mqTime = millis();
+  _queued(_mqLen++) = AsyncEventSourceMessage(std::move(msg), std::move(key));
 
   /*
     throttle queue run
@@ -206,75 +303,149 @@ bool AsyncEventSourceClient::_queueMessage(const char* message, size_t len) {
     forcing Q run will only eat more heap ram and blow the buffer, let's just keep data in our own queue
     the queue will be processed at least on each onAck()/onPoll() call from AsyncTCP
   */
-  if (_messageQueue.size() < SSE_MAX_QUEUED_MESSAGES >> 2 && _client->canSend()) {
+  if (_mqLen < SSE_MAX_QUEUED_MESSAGES >> 2 && _client && _client->canSend() && !_holdBack()) {
     _runQueue();
   }
-
   return true;
 }
 
-bool AsyncEventSourceClient::_queueMessage(AsyncEvent_SharedData_t&& msg) {
-  if (_messageQueue.size() >= SSE_MAX_QUEUED_MESSAGES) {
-#ifdef ESP8266
-    ets_printf(String(F("ERROR: Too many messages queued\n")).c_str());
-#elif defined(ESP32)
-    log_e("Event message queue overflow: discard message");
-#endif
-    return false;
+bool AsyncEventSourceClient::_post(const AsyncEvent_SharedData_t& msg, const AsyncEvent_SharedData_t& key) {
+#ifdef ESP32
+  // a broadcast does not wait for the client lock: while it is held the event is handed over to be queued
+  // by the holder, only a full handoff falls back to waiting for the lock
+  if (_lockmq.try_lock()) {
+    _takePending();
+    const bool queued = _client && _client->connected() && _enqueue(AsyncEvent_SharedData_t(msg), key);
+    _lockmq.unlock();
+    _drainPending();
+    return queued;
   }
+  if (_pending.push({msg, key})) {
+    _drainPending();
+    return true;
+  }
+#endif
+  return _queueMessage(AsyncEvent_SharedData_t(msg), key);
+}
 
 #ifdef ESP32
-  // length() is not thread-safe, thus acquiring the lock before this call..
-  std::lock_guard<std::mutex> lock(_lockmq);
+void AsyncEventSourceClient::_takePending() {
+  // lock must be held by the caller, events for a closed connection are dropped
+  if (!_pending.pending())
+    return;
+  _pending.drain([this](pending_t& p) {
+    if (_client)
+      _enqueue(std::move(p.message), std::move(p.key));
+  });
+}
 #endif
 
-  _messageQueue.emplace_back(std::move(msg));
-
-  /*
-    throttle queue run
-    if Q is filled for >25% then network/CPU is congested, since there is no zero-copy mode for socket buff
-    forcing Q run will only eat more heap ram and blow the buffer, let's just keep data in our own queue
-    the queue will be processed at least on each onAck()/onPoll() call from AsyncTCP
-  */
-  if (_messageQueue.size() < SSE_MAX_QUEUED_MESSAGES >> 2 && _client->canSend()) {
-    _runQueue();
+void AsyncEventSourceClient::_drainPending() {
+#ifdef ESP32
+  // called after pushing an event and after releasing the lock: either the pusher sees the lock free,
+  // or the holder sees the event once it has released the lock, so none is left behind
+  for (;;) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!_pending.pending() || !_lockmq.try_lock())
+      return;
+    _takePending();
+    _lockmq.unlock();
   }
-  return true;
+#endif
+}
+
+bool AsyncEventSourceClient::_holdBack() {
+  // lock must be held by the caller
+  // only while data is in flight, its acknowledgement runs the queue again
+  if (!_server->coalesceBytes() || !_inflight || millis() - _mqTime >= _server->coalesceDelay())
+    return false;
+  size_t waiting = 0;
+  for (size_t i = _mqSent; i < _mqLen; ++i)
+    waiting += _queued(i).length();
+  return waiting < _server->coalesceBytes();
 }
 
 void AsyncEventSourceClient::_onAck(size_t len __attribute__((unused)), uint32_t time __attribute__((unused))) {
+  // sent before taking the lock, which queueing them takes
+  _server->_runPosted();
+
+  {
 #ifdef ESP32
-  // Same here, acquiring the lock early
-  std::lock_guard<std::mutex> lock(_lockmq);
+    // Same here, acquiring the lock early
+    std::lock_guard<std::mutex> lock(_lockmq);
 #endif
+    _adaptWindow(len, time);
 
-  // adjust in-flight len
-  if (len < _inflight)
-    _inflight -= len;
-  else
-    _inflight = 0;
-
-  // acknowledge as much messages's data as we got confirmed len from a AsyncTCP
-  while (len && _messageQueue.size()) {
-    len = _messageQueue.front().ack(len);
-    if (_messageQueue.front().finished()) {
-      // now we could release full ack'ed messages, we were keeping it unless send confirmed from AsyncTCP
-      _messageQueue.pop_front();
+    _lastAck = millis();
+
+    // adjust in-flight len
+    if (len < _inflight)
+      _inflight -= len;
+    else
+      _inflight = 0;
+
+    // acknowledge as much messages's data as we got confirmed len from a AsyncTCP
+    while (len && _mqLen) {
+      AsyncEventSourceMessage& m = _queued(0);
+      len = m.ack(len);
+      if (m.finished()) {
+        // now we could release full ack'ed messages, we were keeping it unless send confirmed from AsyncTCP
+        m = AsyncEventSourceMessage();
+        _mqHead = (_mqHead + 1) % SSE_MAX_QUEUED_MESSAGES;
+        --_mqLen;
+        if (_mqSent)
+          --_mqSent;
+      }
     }
-  }
 
-  // try to send another batch of data
-  if (_messageQueue.size())
-    _runQueue();
+#ifdef ESP32
+    // events handed over meanwhile, into the room just acknowledged
+    _takePending();
+#endif
+
+    // try to send another batch of data
+    if (_mqLen && !_holdBack())
+      _runQueue();
+  }
+  _drainPending();
 }
 
 void AsyncEventSourceClient::_onPoll() {
-  if (_messageQueue.size()) {
+  _server->_runPosted();
+
+  bool stalled = false;
+  {
 #ifdef ESP32
     // Same here, acquiring the lock early
     std::lock_guard<std::mutex> lock(_lockmq);
+    _takePending();
 #endif
-    _runQueue();
+    const uint32_t now = millis();
+    const uint32_t stallTimeout = _server->_stallTimeoutMs();
+    const uint32_t heartbeatPeriod = _server->_heartbeatPeriodMs();
+    if (stallTimeout && _inflight && now - _lastAck >= stallTimeout) {
+      stalled = true;
+    } else {
+      // an idle connection gets a comment line, which clients ignore
+      if (heartbeatPeriod && !_mqLen && now - _lastWrite >= heartbeatPeriod && _server->_heartbeatMessage()) {
+        _mqTime = now;
+        _queued(_mqLen++) = AsyncEventSourceMessage(_server->_heartbeatMessage());
+      }
+      if (_mqLen && !_holdBack())
+        _runQueue();
+    }
+  }
+
+  _drainPending();
+
+  // closed without the lock held, the client may be deleted on disconnect
+  if (stalled && _client) {
+#ifdef ESP8266
+    ets_printf("AsyncEventSourceClient::_onPoll: No ack received: closing connection\n");
+#elif defined(ESP32)
+    log_e("No ack received: closing connection");
+#endif
+    _client->close(true);
   }
 }
 
@@ -284,21 +455,44 @@ void AsyncEventSourceClient::_onTimeout(uint32_t time __attribute__((unused))) {
 }
 
 void AsyncEventSourceClient::_onDisconnect() {
-  if (!_client)
-    return;
-  _client = nullptr;
+  {
+#ifdef ESP32
+    // a task queueing an event holds the lock while it uses the connection, which is freed once this returns
+    std::lock_guard<std::mutex> lock(_lockmq);
+#endif
+    if (!_client)
+      return;
+    _client = nullptr;
+  }
   _server->_handleDisconnect(this);
 }
 
 void AsyncEventSourceClient::close() {
-  if (_client)
-    _client->close();
+  AsyncClient* client;
+  {
+#ifdef ESP32
+    std::lock_guard<std::mutex> lock(_lockmq);
+#endif
+    client = _client;
+  }
+  // closing may call _onDisconnect() right away, which takes the lock
+  if (client)
+    client->close();
+}
+
+bool AsyncEventSourceClient::connected() const {
+#ifdef ESP32
+  std::lock_guard<std::mutex> lock(_lockmq);
+#endif
+  return _client && _client->connected();
 }
 
 bool AsyncEventSourceClient::send(const char* message, const char* event, uint32_t id, uint32_t reconnect) {
-  if (!connected())
-    return false;
-  return _queueMessage(std::make_shared<String>(generateEventMessage(message, event, id, reconnect)));
+  return _queueMessage(generateEventMessage(message, event, id, reconnect));
+}
+
+bool AsyncEventSourceClient::sendLatest(const char* message, const char* event, uint32_t id, uint32_t reconnect) {
+  return _queueMessage(generateEventMessage(message, event, id, reconnect), event ? std::make_shared<String>(event) : nullptr);
 }
 
 void AsyncEventSourceClient::_runQueue() {
@@ -307,25 +501,63 @@ void AsyncEventSourceClient::_runQueue() {
 
   // there is no need to lock the mutex here, 'cause all the calls to this method must be already lock'ed
   size_t total_bytes_written = 0;
-  for (auto i = _messageQueue.begin(); i != _messageQueue.end(); ++i) {
-    if (!i->sent()) {
-      const size_t bytes_written = i->write(_client);
-      total_bytes_written += bytes_written;
-      _inflight += bytes_written;
-      if (bytes_written == 0 || _inflight > _max_inflight) {
-        // Serial.print("_");
-        break;
-      }
+  // the stall timer starts with the first byte in flight
+  if (!_inflight)
+    _lastAck = millis();
+  // resume from the first message not fully written
+  for (size_t i = _mqSent; i < _mqLen; ++i) {
+    AsyncEventSourceMessage& m = _queued(i);
+    const size_t bytes_written = m.write(_client);
+    total_bytes_written += bytes_written;
+    _inflight += bytes_written;
+    if (m.sent())
+      _mqSent = i + 1;
+    if (bytes_written == 0 || _inflight > _max_inflight) {
+      // Serial.print("_");
+      break;
     }
   }
 
   // flush socket
-  if (total_bytes_written)
+  if (total_bytes_written) {
+    _lastWrite = millis();
     _client->send();
+  }
+}
+
+void AsyncEventSourceClient::_adaptWindow(size_t len, uint32_t time) {
+  // lock must be held by the caller
+  if (!len)
+    return;
+  _windowAcked += len;
+  _windowSlowest = std::max(_windowSlowest, time);
+  if (_windowAcked < _max_inflight)
+    return;
+
+  // decide once per window of acknowledged data: halve it if acks got late, grow it if it held messages back
+  size_t window = _max_inflight;
+  if (_ackTime && _windowSlowest > 2 * _ackTime + SSE_ACK_SLACK_MS)
+    window = std::max<size_t>(window / 2, SSE_MIN_INFLIGH);
+  else if (_mqSent < _mqLen)
+    window = std::min<size_t>(window + SSE_INFLIGH_STEP, SSE_MAX_INFLIGH);
+  if (window != _max_inflight && _server->_resizeInflight(_max_inflight, window))
+    _max_inflight = window;
+
+  _ackTime = _ackTime ? (_ackTime * 7 + _windowSlowest) / 8 : _windowSlowest;
+  _windowAcked = 0;
+  _windowSlowest = 0;
+}
+
+bool AsyncEventSourceClient::subscribe(const String& topic) {
+  return _server->subscribe(this, topic);
+}
+
+bool AsyncEventSourceClient::unsubscribe(const String& topic) {
+  return _server->unsubscribe(this, topic);
 }
 
 void AsyncEventSourceClient::set_max_inflight_bytes(size_t value) {
-  if (value >= SSE_MIN_INFLIGH && value <= SSE_MAX_INFLIGH)
+  if (value >= SSE_MIN_INFLIGH && value <= SSE_MAX_INFLIGH && _server->_resizeInflight(_max_inflight, value, true))
     _max_inflight = value;
 }
 
@@ -337,40 +569,116 @@ void AsyncEventSource::authorizeConnect(ArAuthorizeConnectHandler cb) {
   addMiddleware(m);
 }
 
+std::shared_ptr<const AsyncEventSource::clients_t> AsyncEventSource::_snapshot() const {
+#ifdef ESP32
+  std::lock_guard<std::mutex> lock(_client_queue_lock);
+#endif
+  return _clients;
+}
+
 void AsyncEventSource::_addClient(AsyncEventSourceClient* client) {
   if (!client)
     return;
+  // events posted before the client connected are not for it, they would arrive stale
+  _runPosted();
+  std::vector<AsyncEvent_SharedData_t> replay;
 #ifdef ESP32
-  std::lock_guard<std::mutex> lock(_client_queue_lock);
+  // the client lock is taken before a broadcast can see the client, so new events are handed over behind the
+  // replayed ones, which are queued and written to the socket once the server lock is released
+  std::unique_lock<std::mutex> clientLock(client->_lockmq, std::defer_lock);
+#endif
+  {
+#ifdef ESP32
+    std::lock_guard<std::mutex> lock(_client_queue_lock);
+    clientLock.lock();
+#endif
+    auto clients = std::make_shared<clients_t>(*_clients);
+    clients->emplace_back(client);
+    _clients = std::move(clients);
+    _inflightTotal += client->get_max_inflight_bytes();
+
+    // topics requested with the connection
+    for (const auto& topic : client->_topics) {
+      auto& subscribers = _topics[topic];
+      auto list = subscribers ? std::make_shared<clients_t>(*subscribers) : std::make_shared<clients_t>();
+      list->push_back(_clients->back());
+      subscribers = std::move(list);
+    }
+
+    // resume a reconnecting client where it left off, only if all it missed is kept and fits in its queue
+    if (client->lastId() && _replayMaxBytes) {
+      bool complete = _replayLostId <= client->lastId();
+      for (auto e = _replay.begin(); complete && e != _replay.end(); ++e) {
+        if (e->id <= client->lastId() || (e->topic && std::find(client->_topics.begin(), client->_topics.end(), *e->topic) == client->_topics.end()))
+          continue;
+        complete = replay.size() < SSE_MAX_QUEUED_MESSAGES;
+        if (complete)
+          replay.push_back(e->message);
+      }
+      if (!complete) {
+        replay.clear();
+        replay.push_back(generateEventMessage("", T_reset, std::max<uint32_t>(_replayLostId, _replay.size() ? _replay.back().id : 0), 0));
+      }
+    }
+  }
+
+  for (auto& message : replay)
+    client->_enqueue(std::move(message), nullptr);
+#ifdef ESP32
+  clientLock.unlock();
 #endif
-  _clients.emplace_back(client);
+  // events handed over to the client while its lock was held
+  client->_drainPending();
+
   if (_connectcb)
     _connectcb(client);
-
-  _adjust_inflight_window();
 }
 
 void AsyncEventSource::_handleDisconnect(AsyncEventSourceClient* client) {
   if (_disconnectcb)
     _disconnectcb(client);
+  // the client is deleted once the lock is released and no snapshot refers to it anymore
+  std::shared_ptr<AsyncEventSourceClient> removed;
+  {
 #ifdef ESP32
-  std::lock_guard<std::mutex> lock(_client_queue_lock);
+    std::lock_guard<std::mutex> lock(_client_queue_lock);
 #endif
-  for (auto i = _clients.begin(); i != _clients.end(); ++i) {
-    if (i->get() == client)
-      _clients.erase(i);
+    auto clients = std::make_shared<clients_t>();
+    clients->reserve(_clients->size());
+    for (const auto& c : *_clients) {
+      if (c.get() == client)
+        removed = c;
+      else
+        clients->push_back(c);
+    }
+    _clients = std::move(clients);
+    if (removed) {
+      for (const auto& topic : removed->_topics)
+        _removeSubscriber(topic, client);
+    }
   }
-  _adjust_inflight_window();
+  if (removed)
+    _inflightTotal -= removed->get_max_inflight_bytes();
+}
+
+bool AsyncEventSource::_resizeInflight(size_t oldSize, size_t newSize, bool force) {
+  if (newSize <= oldSize) {
+    _inflightTotal -= oldSize - newSize;
+    return true;
+  }
+  const size_t grow = newSize - oldSize;
+  size_t total = _inflightTotal.load();
+  do {
+    if (!force && total + grow > SSE_MAX_INFLIGH_TOTAL)
+      return false;
+  } while (!_inflightTotal.compare_exchange_weak(total, total + grow));
+  return true;
 }
 
 void AsyncEventSource::close() {
-  // While the whole loop is not done, the linked list is locked and so the
-  // iterator should remain valid even when AsyncEventSource::_handleDisconnect()
-  // is called very early
-#ifdef ESP32
-  std::lock_guard<std::mutex> lock(_client_queue_lock);
-#endif
-  for (const auto& c : _clients) {
+  // closing a client may remove it from the list right away, so walk a snapshot without holding the lock
+  auto clients = _snapshot();
+  for (const auto& c : *clients) {
     if (c->connected())
       c->close();
   }
@@ -380,31 +688,81 @@ void AsyncEventSource::close() {
 size_t AsyncEventSource::avgPacketsWaiting() const {
   size_t aql = 0;
   uint32_t nConnectedClients = 0;
-#ifdef ESP32
-  std::lock_guard<std::mutex> lock(_client_queue_lock);
-#endif
-  if (!_clients.size())
-    return 0;
-
-  for (const auto& c : _clients) {
+  auto clients = _snapshot();
+  for (const auto& c : *clients) {
     if (c->connected()) {
       aql += c->packetsWaiting();
       ++nConnectedClients;
     }
   }
+  if (!nConnectedClients)
+    return 0;
   return ((aql) + (nConnectedClients / 2)) / (nConnectedClients); // round up
 }
 
 AsyncEventSource::SendStatus AsyncEventSource::send(
   const char* message, const char* event, uint32_t id, uint32_t reconnect) {
-  AsyncEvent_SharedData_t shared_msg = std::make_shared<String>(generateEventMessage(message, event, id, reconnect));
+  return _send(generateEventMessage(message, event, id, reconnect), id);
+}
+
+AsyncEventSource::SendStatus AsyncEventSource::send(AsyncEventSourceEvent& event) {
+  return _send(event.message(), event.id());
+}
+
+bool AsyncEventSource::post(const char* message, const char* event, uint32_t id, uint32_t reconnect) {
+  return _post({generateEventMessage(message, event, id, reconnect), id});
+}
+
+bool AsyncEventSource::post(AsyncEventSourceEvent& event) {
+  return _post({event.message(), event.id()});
+}
+
+bool AsyncEventSource::_post(posted_t&& posted) {
+  if (_posted.push(std::move(posted)))
+    return true;
+  // only acknowledgements and polls of the clients drain the queue, with none connected the caller drops what waits
+  if (count())
+    return false;
+  _runPosted();
+  return _posted.push(std::move(posted));
+}
+
+void AsyncEventSource::_runPosted() {
+  _posted.drain([this](posted_t& p) { _send(std::move(p.message), p.id); });
+}
+
+AsyncEventSource::SendStatus AsyncEventSource::sendLatest(const char* message, const char* event, uint32_t id, uint32_t reconnect) {
+  // the key is shared by the messages queued for all the clients
+  return _send(generateEventMessage(message, event, id, reconnect), id, event ? std::make_shared<String>(event) : nullptr);
+}
+
+AsyncEventSource::SendStatus AsyncEventSource::_send(AsyncEvent_SharedData_t shared_msg, uint32_t id, AsyncEvent_SharedData_t key, const String* topic) {
+  // the lock is only held to log the event and take the clients, not while it is queued for each of them
+  std::shared_ptr<const clients_t> clients;
+  {
 #ifdef ESP32
-  std::lock_guard<std::mutex> lock(_client_queue_lock);
+    std::lock_guard<std::mutex> lock(_client_queue_lock);
 #endif
+    if (id && _replayMaxBytes) {
+      _replayBytes += shared_msg->length();
+      _replay.push_back({id, shared_msg, topic ? std::make_shared<String>(*topic) : nullptr});
+      _trimReplay();
+    } else if (id) {
+      _replayLostId = std::max<uint32_t>(_replayLostId, id);
+    }
+    if (!topic) {
+      clients = _clients;
+    } else {
+      auto iter = _topics.find(*topic);
+      if (iter == _topics.end())
+        return DISCARDED;
+      clients = iter->second;
+    }
+  }
   size_t hits = 0;
   size_t miss = 0;
-  for (const auto& c : _clients) {
-    if (c->write(shared_msg))
+  for (const auto& c : *clients) {
+    if (c->_post(shared_msg, key))
       ++hits;
     else
       ++miss;
@@ -412,12 +770,97 @@ AsyncEventSource::SendStatus AsyncEventSource::send(
   return hits == 0 ? DISCARDED : (miss == 0 ? ENQUEUED : PARTIALLY_ENQUEUED);
 }
 
-size_t AsyncEventSource::count() const {
+bool AsyncEventSource::subscribe(AsyncEventSourceClient* client, const String& topic) {
+#ifdef ESP32
+  std::lock_guard<std::mutex> lock(_client_queue_lock);
+#endif
+  auto owner = std::find_if(_clients->begin(), _clients->end(), [client](const std::shared_ptr<AsyncEventSourceClient>& c) { return c.get() == client; });
+  if (owner == _clients->end())
+    return false;
+  if (std::find(client->_topics.begin(), client->_topics.end(), topic) != client->_topics.end())
+    return true;
+  client->_topics.push_back(topic);
+  auto& subscribers = _topics[topic];
+  auto list = subscribers ? std::make_shared<clients_t>(*subscribers) : std::make_shared<clients_t>();
+  list->push_back(*owner);
+  subscribers = std::move(list);
+  return true;
+}
+
+bool AsyncEventSource::unsubscribe(AsyncEventSourceClient* client, const String& topic) {
 #ifdef ESP32
   std::lock_guard<std::mutex> lock(_client_queue_lock);
 #endif
+  // a client of another source, or one already freed, is not dereferenced
+  if (std::none_of(_clients->begin(), _clients->end(), [client](const std::shared_ptr<AsyncEventSourceClient>& c) { return c.get() == client; }))
+    return false;
+  auto sub = std::find(client->_topics.begin(), client->_topics.end(), topic);
+  if (sub == client->_topics.end())
+    return false;
+  client->_topics.erase(sub);
+  _removeSubscriber(topic, client);
+  return true;
+}
+
+void AsyncEventSource::_removeSubscriber(const String& topic, AsyncEventSourceClient* client) {
+  // lock must be held by the caller
+  auto iter = _topics.find(topic);
+  if (iter == _topics.end())
+    return;
+  auto list = std::make_shared<clients_t>();
+  for (const auto& c : *iter->second) {
+    if (c.get() != client)
+      list->push_back(c);
+  }
+  if (list->empty())
+    _topics.erase(iter);
+  else
+    iter->second = std::move(list);
+}
+
+size_t AsyncEventSource::subscribers(const String& topic) const {
+#ifdef ESP32
+  std::lock_guard<std::mutex> lock(_client_queue_lock);
+#endif
+  auto iter = _topics.find(topic);
+  return iter == _topics.end() ? 0 : iter->second->size();
+}
+
+AsyncEventSource::SendStatus AsyncEventSource::publish(const String& topic, const char* message, const char* event, uint32_t id, uint32_t reconnect) {
+  return _send(generateEventMessage(message, event, id, reconnect), id, nullptr, &topic);
+}
+
+AsyncEventSource::SendStatus AsyncEventSource::publish(const String& topic, AsyncEventSourceEvent& event) {
+  return _send(event.message(), event.id(), nullptr, &topic);
+}
+
+void AsyncEventSource::enableReplay(size_t maxBytes) {
+#ifdef ESP32
+  std::lock_guard<std::mutex> lock(_client_queue_lock);
+#endif
+  _replayMaxBytes = maxBytes;
+  _trimReplay();
+}
+
+void AsyncEventSource::setHeartbeat(uint16_t seconds) {
+  if (seconds && !_heartbeat)
+    _heartbeat = std::make_shared<String>(T_sse_comment);
+  _heartbeatPeriod = seconds * 1000;
+}
+
+void AsyncEventSource::_trimReplay() {
+  // lock must be held by the caller
+  while (_replay.size() && _replayBytes > _replayMaxBytes) {
+    _replayBytes -= _replay.front().message->length();
+    _replayLostId = std::max<uint32_t>(_replayLostId, _replay.front().id);
+    _replay.pop_front();
+  }
+}
+
+size_t AsyncEventSource::count() const {
   size_t n_clients{0};
-  for (const auto& i : _clients)
+  auto clients = _snapshot();
+  for (const auto& i : *clients)
     if (i->connected())
       ++n_clients;
 
@@ -432,15 +875,6 @@ void AsyncEventSource::handleRequest(AsyncWebServerRequest* request) {
   request->send(new AsyncEventSourceResponse(this));
 }
 
-void AsyncEventSource::_adjust_inflight_window() {
-  if (_clients.size()) {
-    size_t inflight = SSE_MAX_INFLIGH / _clients.size();
-    for (const auto& c : _clients)
-      c->set_max_inflight_bytes(inflight);
-    // Serial.printf("adjusted inflight to: %u\n", inflight);
-  }
-}
-
 /*  Response  */
 
 AsyncEventSourceResponse::AsyncEventSourceResponse(AsyncEventSource* server) {
@@ -46,8 +46,45 @@
   #define SSE_MAX_INFLIGH 16 * 1024 // but no more than 16k, no need to blow it, since same data is kept in local Q
 #endif
 
+// unacknowledged bytes all the clients together may have in flight, each client window adapts within it
+#ifndef SSE_MAX_INFLIGH_TOTAL
+  #ifdef ESP8266
+    #define SSE_MAX_INFLIGH_TOTAL 16 * 1024
+  #else
+    #define SSE_MAX_INFLIGH_TOTAL 48 * 1024
+  #endif
+#endif
+
+// bytes of past events kept for clients that reconnect with a Last-Event-ID, see AsyncEventSource::enableReplay()
+#ifndef SSE_REPLAY_MAX_BYTES
+  #ifdef ESP8266
+    #define SSE_REPLAY_MAX_BYTES 2048
+  #else
+    #define SSE_REPLAY_MAX_BYTES 8192
+  #endif
+#endif
+
+// events posted from other tasks waiting for the network task, a power of two
+#ifndef SSE_POST_QUEUE_SIZE
+  #ifdef ESP8266
+    #define SSE_POST_QUEUE_SIZE 8
+  #else
+    #define SSE_POST_QUEUE_SIZE 16
+  #endif
+#endif
+
+// events a broadcast hands to each client without taking its lock, a power of two
+#ifndef SSE_CLIENT_HANDOFF_SIZE
+  #define SSE_CLIENT_HANDOFF_SIZE 8
+#endif
+
+#include "AsyncMpscQueue.h"
 #include <ESPAsyncWebServer.h>
 
+#include <atomic>
+#include <deque>
+#include <map>
+
 #ifdef ESP8266
   #include <Hash.h>
   #ifdef CRYPTO_HASH_h // include Hash.h from espressif framework if the first include was from the crypto library
@@ -63,6 +100,41 @@ using ArAuthorizeConnectHandler = ArAuthorizeFunction;
 // shared message object container
 using AsyncEvent_SharedData_t = std::shared_ptr<String>;
 
+/**
+ * @brief SSE event formatter, everything printed to it becomes the data of one event
+ * Line breaks (\n, \r or \r\n) in the data start a new "data:" line, so a JSON document can be serialized
+ * straight into the event: serializeJson(doc, event). The buffer is allocated once up front when the size
+ * of the data is given, e.g. measureJson(doc), then the event is handed to AsyncEventSource::send().
+ */
+class AsyncEventSourceEvent : public Print {
+  private:
+    String _str;
+    uint32_t _id;
+    bool _lineOpen{false}; // a "data:" line was started and not ended yet
+    bool _cr{false};       // last byte was a \r, a \n right after it ends the same line
+
+  public:
+    /**
+     * @param event event name, NULL for none
+     * @param id event id, 0 for none
+     * @param reconnect client's reconnect timeout, 0 to leave it unchanged
+     * @param dataLen bytes of data that will be printed, line breaks excluded
+     * @param dataLines number of lines of that data
+     */
+    AsyncEventSourceEvent(const char* event = NULL, uint32_t id = 0, uint32_t reconnect = 0, size_t dataLen = 0, size_t dataLines = 1);
+
+    size_t write(uint8_t c);
+    size_t write(const uint8_t* buffer, size_t size);
+    using Print::write;
+
+    uint32_t id() const { return _id; }
+
+    /**
+     * @brief end the event and take its formatted text, to be called once all the data is printed
+     */
+    AsyncEvent_SharedData_t message();
+};
+
 /**
  * @brief Async Event Message container with shared message content data
  *
@@ -70,12 +142,15 @@ using AsyncEvent_SharedData_t = std::shared_ptr<String>;
 class AsyncEventSourceMessage {
 
   private:
-    const AsyncEvent_SharedData_t _data;
-    size_t _sent{0};  // num of bytes already sent
-    size_t _acked{0}; // num of bytes acked
+    AsyncEvent_SharedData_t _data;
+    AsyncEvent_SharedData_t _key; // event name of a latest value message, replaced by a newer one until sent
+    size_t _sent{0};              // num of bytes already sent
+    size_t _acked{0};             // num of bytes acked
 
   public:
-    AsyncEventSourceMessage(AsyncEvent_SharedData_t data) : _data(data) {};
+    // an empty queue slot
+    AsyncEventSourceMessage() {};
+    AsyncEventSourceMessage(AsyncEvent_SharedData_t data, AsyncEvent_SharedData_t key = nullptr) : _data(data), _key(key) {};
 #ifdef ESP32
     AsyncEventSourceMessage(const char* data, size_t len) : _data(std::make_shared<String>(data, len)) {};
 #else
@@ -118,6 +193,10 @@ class AsyncEventSourceMessage {
      *
      */
     bool sent() { return _sent == _data->length(); }
+
+    size_t length() const { return _data->length(); }
+    bool started() const { return _sent != 0; }
+    const AsyncEvent_SharedData_t& key() const { return _key; }
 };
 
 /**
@@ -125,19 +204,51 @@ class AsyncEventSourceMessage {
  *
  */
 class AsyncEventSourceClient {
+    friend AsyncEventSource;
+
   private:
     AsyncClient* _client;
     AsyncEventSource* _server;
     uint32_t _lastId{0};
+    // topics subscribed, guarded by the server lock
+    std::vector<String> _topics;
     size_t _inflight{0};                   // num of unacknowledged bytes that has been written to socket buffer
-    size_t _max_inflight{SSE_MAX_INFLIGH}; // max num of unacknowledged bytes that could be written to socket buffer
-    std::list<AsyncEventSourceMessage> _messageQueue;
+    size_t _max_inflight{SSE_MIN_INFLIGH}; // max num of unacknowledged bytes that could be written to socket buffer
+    // in-flight window control: smoothed ack time, and bytes acked and slowest ack since the window last changed
+    uint32_t _ackTime{0};
+    size_t _windowAcked{0};
+    uint32_t _windowSlowest{0};
+    // fixed ring of queued messages, so queueing allocates nothing: _mqLen messages from _mqHead, oldest first,
+    // of which the first _mqSent are fully written to the socket and only wait for their ack
+    AsyncEventSourceMessage _messageQueue[SSE_MAX_QUEUED_MESSAGES];
+    size_t _mqHead{0};
+    size_t _mqLen{0};
+    size_t _mqSent{0};
+    // when the oldest message not written yet was queued, for coalescing
+    uint32_t _mqTime{0};
+    // when data was last written, and when the oldest data in flight was written or last acknowledged
+    uint32_t _lastWrite{0};
+    uint32_t _lastAck{0};
 #ifdef ESP32
     mutable std::mutex _lockmq;
+    // broadcast events waiting for whoever holds _lockmq next, see _post()
+    struct pending_t {
+        AsyncEvent_SharedData_t message;
+        AsyncEvent_SharedData_t key;
+    };
+    AsyncMpscQueue<pending_t, SSE_CLIENT_HANDOFF_SIZE> _pending;
+    void _takePending();
 #endif
     bool _queueMessage(const char* message, size_t len);
-    bool _queueMessage(AsyncEvent_SharedData_t&& msg);
+    bool _queueMessage(AsyncEvent_SharedData_t&& msg, AsyncEvent_SharedData_t key = nullptr);
+    bool _enqueue(AsyncEvent_SharedData_t&& msg, AsyncEvent_SharedData_t key);
+    bool _post(const AsyncEvent_SharedData_t& msg, const AsyncEvent_SharedData_t& key);
+    void _drainPending();
+    bool _holdBack();
     void _runQueue();
+    void _adaptWindow(size_t len, uint32_t time);
+    // i-th queued message from the oldest one
+    AsyncEventSourceMessage& _queued(size_t i) { return _messageQueue[(_mqHead + i) % SSE_MAX_QUEUED_MESSAGES]; }
 
   public:
     AsyncEventSourceClient(AsyncWebServerRequest* request, AsyncEventSource* server);
@@ -157,19 +268,35 @@ class AsyncEventSourceClient {
     bool send(const char* message, const char* event = NULL, uint32_t id = 0, uint32_t reconnect = 0);
     bool send(const String& message, const String& event, uint32_t id = 0, uint32_t reconnect = 0) { return send(message.c_str(), event.c_str(), id, reconnect); }
     bool send(const String& message, const char* event, uint32_t id = 0, uint32_t reconnect = 0) { return send(message.c_str(), event, id, reconnect); }
+    // sends an event printed into an AsyncEventSourceEvent
+    bool send(AsyncEventSourceEvent& event) { return write(event.message()); }
+
+    /**
+     * @brief Send the latest value of an event: a message with the same event name that is still queued
+     * and not being sent yet is replaced, so a slow client gets the current value instead of a backlog
+     *
+     * @param event event name, required
+     */
+    bool sendLatest(const char* message, const char* event, uint32_t id = 0, uint32_t reconnect = 0);
+    bool sendLatest(const String& message, const char* event, uint32_t id = 0, uint32_t reconnect = 0) { return sendLatest(message.c_str(), event, id, reconnect); }
+
+    // see AsyncEventSource::subscribe()
+    bool subscribe(const String& topic);
+    bool unsubscribe(const String& topic);
 
     /**
      * @brief place supplied preformatted SSE message to the message queue
      * @note message must a properly formatted SSE string according to https://developer.mozilla.org/en-US/docs/Web/API/Server-sent_events/Using_server-sent_events
      *
      * @param message data
+     * @param key event name the message replaces a queued message of, see sendLatest(), nullptr for none
      * @return true on success
      * @return false on queue overflow or no client connected
      */
-    bool write(AsyncEvent_SharedData_t message) { return connected() && _queueMessage(std::move(message)); };
+    bool write(AsyncEvent_SharedData_t message, AsyncEvent_SharedData_t key = nullptr) { return _queueMessage(std::move(message), std::move(key)); };
 
     [[deprecated("Use _write(AsyncEvent_SharedData_t message) instead to share same data with multiple SSE clients")]]
-    bool write(const char* message, size_t len) { return connected() && _queueMessage(message, len); };
+    bool write(const char* message, size_t len) { return _queueMessage(message, len); };
 
     // close client's connection
     void close();
@@ -177,13 +304,16 @@ class AsyncEventSourceClient {
     // getters
 
     AsyncClient* client() { return _client; }
-    bool connected() const { return _client && _client->connected(); }
+    bool connected() const;
     uint32_t lastId() const { return _lastId; }
-    size_t packetsWaiting() const { return _messageQueue.size(); };
+    size_t packetsWaiting() const { return _mqLen; };
 
     /**
      * @brief Sets max amount of bytes that could be written to client's socket while awaiting delivery acknowledge
      * used to throttle message delivery length to tradeoff memory consumption
+     * @note the window then keeps adapting to the client from this value: it grows by one MSS for each window of data
+     * acknowledged in time while messages wait to be written, and is halved when acks get much slower than usual,
+     * within SSE_MIN_INFLIGH, SSE_MAX_INFLIGH and the SSE_MAX_INFLIGH_TOTAL shared by all the clients
      * @note actual amount of data written could possible be a bit larger but no more than available socket buff space
      *
      * @param value
@@ -212,17 +342,47 @@ class AsyncEventSourceClient {
 class AsyncEventSource : public AsyncWebHandler {
   private:
     String _url;
-    std::list<std::unique_ptr<AsyncEventSourceClient>> _clients;
+    using clients_t = std::vector<std::shared_ptr<AsyncEventSourceClient>>;
+    // Connected clients. The list is never changed in place but replaced on connect and disconnect,
+    // so a snapshot taken under the lock can be walked without it while messages are queued
+    std::shared_ptr<const clients_t> _clients{std::make_shared<const clients_t>()};
 #ifdef ESP32
-    // Same as for individual messages, protect mutations of _clients list
+    // Same as for individual messages, protect the _clients pointer and the replay log
     // since simultaneous access from different tasks is possible
     mutable std::mutex _client_queue_lock;
 #endif
     ArEventHandlerFunction _connectcb = nullptr;
     ArEventHandlerFunction _disconnectcb = nullptr;
-
-    // this method manipulates in-fligh data size for connected client depending on number of active connections
-    void _adjust_inflight_window();
+    // subscribed clients by topic, each list replaced as a whole like _clients
+    std::map<String, std::shared_ptr<const clients_t>> _topics;
+    struct replay_t {
+        uint32_t id;
+        AsyncEvent_SharedData_t message;
+        AsyncEvent_SharedData_t topic; // nullptr for an event sent to all the clients
+    };
+    // recent events with an id, oldest first, replayed to clients resuming from an earlier id
+    std::deque<replay_t> _replay;
+    size_t _replayBytes{0};
+    size_t _replayMaxBytes{0};
+    // greatest id of an event sent but not kept in the replay log anymore, or never kept
+    uint32_t _replayLostId{0};
+
+    void _trimReplay();
+    void _removeSubscriber(const String& topic, AsyncEventSourceClient* client);
+    std::shared_ptr<const clients_t> _snapshot() const;
+
+    // sum of the client in-flight windows
+    std::atomic<size_t> _inflightTotal{0};
+    size_t _coalesceBytes{0};
+    uint32_t _coalesceDelay{0};
+    uint32_t _heartbeatPeriod{0};
+    uint32_t _stallTimeout{0};
+    AsyncEvent_SharedData_t _heartbeat;
+    struct posted_t {
+        AsyncEvent_SharedData_t message;
+        uint32_t id;
+    };
+    AsyncMpscQueue<posted_t, SSE_POST_QUEUE_SIZE> _posted;
 
   public:
     typedef enum {
@@ -231,6 +391,11 @@ class AsyncEventSource : public AsyncWebHandler {
       PARTIALLY_ENQUEUED = 2,
     } SendStatus;
 
+  private:
+    SendStatus _send(AsyncEvent_SharedData_t message, uint32_t id, AsyncEvent_SharedData_t key = nullptr, const String* topic = nullptr);
+    bool _post(posted_t&& posted);
+
+  public:
     AsyncEventSource(const char* url) : _url(url) {};
     AsyncEventSource(const String& url) : _url(url) {};
     ~AsyncEventSource() { close(); };
@@ -256,24 +421,122 @@ class AsyncEventSource : public AsyncWebHandler {
      * @param id sequence id
      * @param reconnect client's reconnect timeout
      * @return SendStatus if message was placed in any/all/part of the client's queues
+     * @note a client busy with its queue gets the message handed over instead of making the caller wait,
+     * it counts as queued even if the queue then overflows
      */
     SendStatus send(const char* message, const char* event = NULL, uint32_t id = 0, uint32_t reconnect = 0);
     SendStatus send(const String& message, const String& event, uint32_t id = 0, uint32_t reconnect = 0) { return send(message.c_str(), event.c_str(), id, reconnect); }
     SendStatus send(const String& message, const char* event, uint32_t id = 0, uint32_t reconnect = 0) { return send(message.c_str(), event, id, reconnect); }
+    // sends an event printed into an AsyncEventSourceEvent
+    SendStatus send(AsyncEventSourceEvent& event);
+    // latest value broadcast, see AsyncEventSourceClient::sendLatest()
+    SendStatus sendLatest(const char* message, const char* event, uint32_t id = 0, uint32_t reconnect = 0);
+    SendStatus sendLatest(const String& message, const char* event, uint32_t id = 0, uint32_t reconnect = 0) { return sendLatest(message.c_str(), event, id, reconnect); }
+
+    /**
+     * @brief Hand an event over to the network task, from any task and without taking a lock
+     * The message is formatted by the caller and sent like with send() by the next acknowledgement or poll of any client,
+     * or when a client connects, so its latency is bounded by the poll interval of the TCP stack (500 ms).
+     * An event still waiting when a client connects goes to the clients connected before, with none it is dropped
+     * (an event with an id is still kept for replay, see enableReplay()).
+     * Without any client nothing drains the queue: once SSE_POST_QUEUE_SIZE events are waiting, the next post()
+     * drops them (keeping those with an id for replay) to queue its own event.
+     *
+     * @return false if SSE_POST_QUEUE_SIZE events are already waiting for the connected clients
+     */
+    bool post(const char* message, const char* event = NULL, uint32_t id = 0, uint32_t reconnect = 0);
+    bool post(const String& message, const char* event = NULL, uint32_t id = 0, uint32_t reconnect = 0) { return post(message.c_str(), event, id, reconnect); }
+    bool post(AsyncEventSourceEvent& event);
+
+    /**
+     * @brief Subscribe a client to a topic, so that it gets the events published to it.
+     * Clients also subscribe when they connect with topic query parameters, e.g. /events?topic=temp&topic=hum.
+     * Events sent with send() still go to all the clients.
+     * @return false if the client is not connected to this source
+     */
+    bool subscribe(AsyncEventSourceClient* client, const String& topic);
+    // @return false if the client is not connected to this source or not subscribed to the topic
+    bool unsubscribe(AsyncEventSourceClient* client, const String& topic);
+    size_t subscribers(const String& topic) const;
+
+    /**
+     * @brief Send an SSE message to the clients subscribed to a topic only,
+     * the message is formatted once and shared by their queues like with send()
+     */
+    SendStatus publish(const String& topic, const char* message, const char* event = NULL, uint32_t id = 0, uint32_t reconnect = 0);
+    SendStatus publish(const String& topic, const String& message, const char* event = NULL, uint32_t id = 0, uint32_t reconnect = 0) { return publish(topic, message.c_str(), event, id, reconnect); }
+    SendStatus publish(const String& topic, AsyncEventSourceEvent& event);
+
+    /**
+     * @brief Let events wait to be written to a client together, off by default
+     * A connection with nothing in flight writes an event right away. While data is in flight,
+     * new events wait for its acknowledgement, which writes them together, unless maxBytes are
+     * waiting or the oldest has waited maxDelay ms when another event is queued or the connection is polled.
+     *
+     * @param maxBytes bytes waiting that are written at once, 0 to write each event as soon as possible
+     * @param maxDelay longest wait for the acknowledgement, in ms
+     */
+    void setCoalescing(size_t maxBytes, uint32_t maxDelay) {
+      _coalesceBytes = maxBytes;
+      _coalesceDelay = maxDelay;
+    }
+    size_t coalesceBytes() const { return _coalesceBytes; }
+    uint32_t coalesceDelay() const { return _coalesceDelay; }
+
+    /**
+     * @brief Send a comment line to clients that had nothing written to them for this many seconds,
+     * keeping idle connections open through proxies and NAT. Checked when the connection is polled. Disabled if zero (default)
+     */
+    void setHeartbeat(uint16_t seconds);
+    uint16_t heartbeat() const { return (uint16_t)(_heartbeatPeriod / 1000); }
+    // the comment line sent as heartbeat, shared by all the clients
+    const AsyncEvent_SharedData_t& _heartbeatMessage() const { return _heartbeat; }
+
+    /**
+     * @brief Close clients that have data in flight not acknowledged for this many seconds,
+     * so a stuck client frees its queue without waiting for the TCP stack to give up. Disabled if zero (default)
+     */
+    void setStallTimeout(uint16_t seconds) { _stallTimeout = seconds * 1000; }
+    uint16_t stallTimeout() const { return (uint16_t)(_stallTimeout / 1000); }
+    uint32_t _heartbeatPeriodMs() const { return _heartbeatPeriod; }
+    uint32_t _stallTimeoutMs() const { return _stallTimeout; }
 
     // The client pointer sent to the callback is only for reference purposes. DO NOT CALL ANY METHOD ON IT !
     void onDisconnect(ArEventHandlerFunction cb) { _disconnectcb = cb; }
     void authorizeConnect(ArAuthorizeConnectHandler cb);
 
+    /**
+     * @brief Keep the latest events sent with an id, up to maxBytes of formatted data.
+     * A client that reconnects with a Last-Event-ID header gets the kept events with a greater id queued
+     * before onConnect() is called and before any new event, instead of having to fetch the whole state again.
+     * When some of the events it missed are not kept anymore, or they are more than its queue holds
+     * (SSE_MAX_QUEUED_MESSAGES), it gets a single "reset" event with an empty data line and the latest id
+     * instead, on which it should fetch the whole state.
+     * Events are shared with the client queues, not copied. Off by default.
+     *
+     * @param maxBytes replay log size, 0 disables it and frees the events kept
+     */
+    void enableReplay(size_t maxBytes = SSE_REPLAY_MAX_BYTES);
+    void disableReplay() { enableReplay(0); }
+    // bytes of formatted events kept for replay
+    size_t replayBytes() const { return _replayBytes; }
+
     // returns number of connected clients
     size_t count() const;
 
     // returns average number of messages pending in all client's queues
     size_t avgPacketsWaiting() const;
 
+    // sum of the client in-flight windows, see AsyncEventSourceClient::set_max_inflight_bytes()
+    size_t inflightTotal() const { return _inflightTotal; }
+
     // system callbacks (do not call from user code!)
     void _addClient(AsyncEventSourceClient* client);
     void _handleDisconnect(AsyncEventSourceClient* client);
+    // sends the posted events, on the network task, or drops them from post() when no client is connected
+    void _runPosted();
+    // moves a client window from oldSize to newSize, a larger one only if it fits SSE_MAX_INFLIGH_TOTAL unless forced
+    bool _resizeInflight(size_t oldSize, size_t newSize, bool force = false);
     bool canHandle(AsyncWebServerRequest* request) const override final;
     void handleRequest(AsyncWebServerRequest* request) override final;
 };
@@ -0,0 +1,473 @@
+#include "AsyncGzip.h"
+
+// longest match deflate can encode, and the input needed ahead of the current position to find it
+#define GZIP_MAX_MATCH     258
+#define GZIP_MIN_MATCH     3
+#define GZIP_MIN_LOOKAHEAD (GZIP_MAX_MATCH + GZIP_MIN_MATCH)
+#define GZIP_END_OF_BLOCK  256
+
+static const uint16_t lengthBase[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const uint8_t lengthExtra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t distanceBase[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const uint8_t distanceExtra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+// longest hash chain walked for each level
+static const uint16_t chainLength[10] = {1, 2, 4, 8, 16, 32, 64, 128, 256, 512};
+
+static const uint32_t crcTable[16] = {
+  0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+  0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C};
+
+static uint32_t reverseBits(uint32_t value, uint8_t count) {
+  uint32_t out = 0;
+  while (count--) {
+    out = (out << 1) | (value & 1);
+    value >>= 1;
+  }
+  return out;
+}
+
+std::atomic<size_t> AsyncGzipEncoder::_memoryInUse{0};
+
+AsyncGzipEncoder::AsyncGzipEncoder(uint8_t level, uint8_t windowBits, bool raw) : _raw(raw) {
+  if (windowBits < 9)
+    windowBits = 9;
+  else if (windowBits > 14)
+    windowBits = 14;
+  if (level > 9)
+    level = 9;
+  _windowBits = windowBits;
+  _wsize = (size_t)1 << windowBits;
+  _maxChain = chainLength[level];
+}
+
+AsyncGzipEncoder::~AsyncGzipEncoder() {
+  if (_window) {
+    free(_window);
+    _memoryInUse -= memoryUsage(_windowBits);
+  }
+}
+
+size_t AsyncGzipEncoder::memoryUsage(uint8_t windowBits) {
+  // window of two halves, previous match of each position and hash heads for half the window size
+  return (size_t)5 << windowBits;
+}
+
+bool AsyncGzipEncoder::begin(size_t maxMemory) {
+  if (_window)
+    return true;
+  size_t size = memoryUsage(_windowBits);
+  // reserved before allocating, so encoders started at the same time cannot go over maxMemory together
+  size_t inUse = _memoryInUse.load();
+  do {
+    if (inUse + size > maxMemory)
+      return false;
+  } while (!_memoryInUse.compare_exchange_weak(inUse, inUse + size));
+  _window = (uint8_t*)malloc(size);
+  if (!_window) {
+    _memoryInUse -= size;
+    return false;
+  }
+  _prev = (uint16_t*)(_window + 2 * _wsize);
+  _head = _prev + _wsize;
+  memset(_prev, 0, 3 * _wsize);
+  return true;
+}
+
+uint8_t* AsyncGzipEncoder::inputBuffer(size_t& len) {
+  len = 0;
+  if (!_window || _inputEnd)
+    return nullptr;
+  if (_windowLen == 2 * _wsize && _pos >= _wsize)
+    _slide();
+  len = 2 * _wsize - _windowLen;
+  return len ? _window + _windowLen : nullptr;
+}
+
+void AsyncGzipEncoder::commit(size_t len) {
+  const uint8_t* data = _window + _windowLen;
+  for (size_t i = 0; !_raw && i < len; i++) {
+    _crc ^= data[i];
+    _crc = (_crc >> 4) ^ crcTable[_crc & 0x0F];
+    _crc = (_crc >> 4) ^ crcTable[_crc & 0x0F];
+  }
+  _windowLen += len;
+  _inputSize += len;
+}
+
+size_t AsyncGzipEncoder::read(uint8_t* out, size_t len) {
+  size_t written = 0;
+  while (written < len) {
+    if (_pendingPos < _pendingLen) {
+      size_t n = std::min(len - written, (size_t)(_pendingLen - _pendingPos));
+      memcpy(out + written, _pending + _pendingPos, n);
+      _pendingPos += n;
+      written += n;
+      continue;
+    }
+    _pendingPos = _pendingLen = 0;
+
+    if (_state == STATE_HEADER) {
+      static const uint8_t header[10] = {0x1F, 0x8B, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xFF};
+      if (!_raw) {
+        memcpy(_pending, header, sizeof(header));
+        _pendingLen = sizeof(header);
+      }
+      // a single block with fixed Huffman codes, final unless a sync flush follows it
+      _putBits(_raw ? 0 : 1, 1);
+      _putBits(1, 2);
+      _state = STATE_BODY;
+    } else if (_state == STATE_BODY) {
+      if (!_window || !_step())
+        break;
+    } else if (_state == STATE_TRAILER) {
+      uint32_t crc = ~_crc;
+      for (uint8_t i = 0; i < 4; i++)
+        _putByte((crc >> (8 * i)) & 0xFF);
+      for (uint8_t i = 0; i < 4; i++)
+        _putByte((_inputSize >> (8 * i)) & 0xFF);
+      _state = STATE_DONE;
+    } else {
+      break;
+    }
+  }
+  return written;
+}
+
+bool AsyncGzipEncoder::_step() {
+  size_t avail = _windowLen - _pos;
+  if (!_inputEnd && avail < GZIP_MIN_LOOKAHEAD)
+    return false;
+
+  if (!avail) {
+    _putSymbol(GZIP_END_OF_BLOCK);
+    // sync flush: an empty stored block, without its 00 00 FF FF length bytes
+    if (_raw)
+      _putBits(0, 3);
+    if (_bitCount)
+      _putBits(0, 8 - _bitCount);
+    _state = _raw ? STATE_DONE : STATE_TRAILER;
+    return true;
+  }
+
+  size_t length = 0;
+  size_t distance = 0;
+  if (avail >= GZIP_MIN_MATCH)
+    length = _longestMatch(_pos, std::min(avail, (size_t)GZIP_MAX_MATCH), distance);
+
+  if (length >= GZIP_MIN_MATCH) {
+    _putMatch(length, distance);
+    // fast levels only index the start of matches
+    size_t indexed = _maxChain > 8 ? length : 1;
+    for (size_t i = 0; i < indexed && _pos + i + GZIP_MIN_MATCH <= _windowLen; i++)
+      _insert(_pos + i);
+    _pos += length;
+  } else {
+    _putSymbol(_window[_pos]);
+    if (avail >= GZIP_MIN_MATCH)
+      _insert(_pos);
+    _pos++;
+  }
+  return true;
+}
+
+void AsyncGzipEncoder::_slide() {
+  memmove(_window, _window + _wsize, _wsize);
+  _windowLen -= _wsize;
+  _pos -= _wsize;
+  // positions are stored plus one, 0 marking an empty slot
+  for (size_t i = 0; i < _wsize; i++)
+    _prev[i] = _prev[i] > _wsize ? _prev[i] - _wsize : 0;
+  for (size_t i = 0; i < _wsize / 2; i++)
+    _head[i] = _head[i] > _wsize ? _head[i] - _wsize : 0;
+}
+
+uint32_t AsyncGzipEncoder::_hash(size_t pos) const {
+  uint32_t key = ((uint32_t)_window[pos] << 16) | ((uint32_t)_window[pos + 1] << 8) | _window[pos + 2];
+  return (uint32_t)(key * 2654435761U) >> (33 - _windowBits);
+}
+
+void AsyncGzipEncoder::_insert(size_t pos) {
+  uint32_t h = _hash(pos);
+  _prev[pos & (_wsize - 1)] = _head[h];
+  _head[h] = pos + 1;
+}
+
+size_t AsyncGzipEncoder::_longestMatch(size_t pos, size_t maxLen, size_t& distance) const {
+  size_t best = 0;
+  size_t candidate = _head[_hash(pos)];
+  uint16_t chain = _maxChain;
+  const uint8_t* current = _window + pos;
+  while (candidate && chain--) {
+    size_t start = candidate - 1;
+    // the previous match slot of older positions has been reused
+    if (pos - start >= _wsize)
+      break;
+    const uint8_t* match = _window + start;
+    if (match[best] == current[best] && match[0] == current[0]) {
+      size_t len = 0;
+      while (len < maxLen && match[len] == current[len])
+        len++;
+      if (len > best) {
+        best = len;
+        distance = pos - start;
+        if (len == maxLen)
+          break;
+      }
+    }
+    candidate = _prev[start & (_wsize - 1)];
+  }
+  return best;
+}
+
+void AsyncGzipEncoder::_putBits(uint32_t value, uint8_t count) {
+  _bits |= value << _bitCount;
+  _bitCount += count;
+  while (_bitCount >= 8) {
+    _putByte(_bits & 0xFF);
+    _bits >>= 8;
+    _bitCount -= 8;
+  }
+}
+
+void AsyncGzipEncoder::_putSymbol(uint16_t symbol) {
+  // fixed Huffman codes of RFC 1951 3.2.6, sent most significant bit first
+  if (symbol < 144)
+    _putBits(reverseBits(0x30 + symbol, 8), 8);
+  else if (symbol < 256)
+    _putBits(reverseBits(0x190 + symbol - 144, 9), 9);
+  else if (symbol < 280)
+    _putBits(reverseBits(symbol - 256, 7), 7);
+  else
+    _putBits(reverseBits(0xC0 + symbol - 280, 8), 8);
+}
+
+void AsyncGzipEncoder::_putMatch(size_t length, size_t distance) {
+  uint8_t code = 28;
+  while (lengthBase[code] > length)
+    code--;
+  _putSymbol(257 + code);
+  if (lengthExtra[code])
+    _putBits(length - lengthBase[code], lengthExtra[code]);
+
+  code = 29;
+  while (distanceBase[code] > distance)
+    code--;
+  _putBits(reverseBits(code, 5), 5);
+  if (distanceExtra[code])
+    _putBits(distance - distanceBase[code], distanceExtra[code]);
+}
+
+/*
+ * Inflater
+ */
+
+namespace {
+  // canonical Huffman code: number of codes of each length and the symbols sorted by code
+  struct InflateTree {
+      uint16_t counts[16];
+      uint16_t symbols[288];
+  };
+
+  struct InflateState {
+      const uint8_t* in;
+      size_t inLen;
+      size_t inPos;
+      uint32_t bits;
+      uint8_t bitCount;
+      bool overrun;
+      uint8_t* out;
+      size_t outSize;
+      size_t outLen;
+  };
+
+  uint32_t inflateBits(InflateState& s, uint8_t count) {
+    while (s.bitCount < count) {
+      if (s.inPos == s.inLen) {
+        s.overrun = true;
+        return 0;
+      }
+      s.bits |= (uint32_t)s.in[s.inPos++] << s.bitCount;
+      s.bitCount += 8;
+    }
+    uint32_t value = s.bits & ((1UL << count) - 1);
+    s.bits >>= count;
+    s.bitCount -= count;
+    return value;
+  }
+
+  void inflateBuildTree(InflateTree& tree, const uint8_t* lengths, uint16_t num) {
+    uint16_t offsets[16];
+    memset(tree.counts, 0, sizeof(tree.counts));
+    for (uint16_t i = 0; i < num; i++)
+      tree.counts[lengths[i]]++;
+    tree.counts[0] = 0;
+    offsets[0] = 0;
+    for (uint8_t i = 1; i < 16; i++)
+      offsets[i] = offsets[i - 1] + tree.counts[i - 1];
+    for (uint16_t i = 0; i < num; i++)
+      if (lengths[i])
+        tree.symbols[offsets[lengths[i]]++] = i;
+  }
+
+  // -1 on a code no tree entry matches
+  int inflateSymbol(InflateState& s, const InflateTree& tree) {
+    int code = 0;
+    // first code of the current length and index of its first symbol
+    int first = 0;
+    int index = 0;
+    for (uint8_t len = 1; len < 16; len++) {
+      code |= inflateBits(s, 1);
+      if (s.overrun)
+        return -1;
+      int count = tree.counts[len];
+      if (code - first < count)
+        return tree.symbols[index + code - first];
+      index += count;
+      first = (first + count) << 1;
+      code <<= 1;
+    }
+    return -1;
+  }
+
+  AsyncInflater::Result inflateCodes(InflateState& s, const InflateTree& lengths, const InflateTree& distances) {
+    while (true) {
+      int symbol = inflateSymbol(s, lengths);
+      if (symbol < 0)
+        return AsyncInflater::DATA_ERROR;
+      if (symbol < 256) {
+        if (s.outLen == s.outSize)
+          return AsyncInflater::OUTPUT_FULL;
+        s.out[s.outLen++] = symbol;
+        continue;
+      }
+      if (symbol == GZIP_END_OF_BLOCK)
+        return AsyncInflater::OK;
+
+      symbol -= 257;
+      if (symbol >= 29)
+        return AsyncInflater::DATA_ERROR;
+      size_t length = lengthBase[symbol] + inflateBits(s, lengthExtra[symbol]);
+      symbol = inflateSymbol(s, distances);
+      if (symbol < 0 || symbol >= 30)
+        return AsyncInflater::DATA_ERROR;
+      size_t distance = distanceBase[symbol] + inflateBits(s, distanceExtra[symbol]);
+      if (s.overrun || distance > s.outLen)
+        return AsyncInflater::DATA_ERROR;
+      if (length > s.outSize - s.outLen)
+        return AsyncInflater::OUTPUT_FULL;
+      // byte by byte: the match may overlap the bytes it produces
+      for (size_t i = 0; i < length; i++, s.outLen++)
+        s.out[s.outLen] = s.out[s.outLen - distance];
+    }
+  }
+
+  AsyncInflater::Result inflateStored(InflateState& s) {
+    // stored data starts on a byte boundary
+    s.bits = 0;
+    s.bitCount = 0;
+    if (s.inLen - s.inPos < 4)
+      return AsyncInflater::DATA_ERROR;
+    size_t len = s.in[s.inPos] | (s.in[s.inPos + 1] << 8);
+    size_t nlen = s.in[s.inPos + 2] | (s.in[s.inPos + 3] << 8);
+    s.inPos += 4;
+    if (len != (~nlen & 0xFFFF) || len > s.inLen - s.inPos)
+      return AsyncInflater::DATA_ERROR;
+    if (len > s.outSize - s.outLen)
+      return AsyncInflater::OUTPUT_FULL;
+    memcpy(s.out + s.outLen, s.in + s.inPos, len);
+    s.inPos += len;
+    s.outLen += len;
+    return AsyncInflater::OK;
+  }
+
+  AsyncInflater::Result inflateFixed(InflateState& s) {
+    InflateTree lengths;
+    InflateTree distances;
+    uint8_t bits[288];
+    memset(bits, 8, 144);
+    memset(bits + 144, 9, 112);
+    memset(bits + 256, 7, 24);
+    memset(bits + 280, 8, 8);
+    inflateBuildTree(lengths, bits, 288);
+    memset(bits, 5, 30);
+    inflateBuildTree(distances, bits, 30);
+    return inflateCodes(s, lengths, distances);
+  }
+
+  AsyncInflater::Result inflateDynamic(InflateState& s) {
+    static const uint8_t order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+    InflateTree lengths;
+    InflateTree distances;
+    uint8_t bits[286 + 30];
+
+    uint16_t nlen = inflateBits(s, 5) + 257;
+    uint16_t ndist = inflateBits(s, 5) + 1;
+    uint8_t ncode = inflateBits(s, 4) + 4;
+    if (s.overrun || nlen > 286 || ndist > 30)
+      return AsyncInflater::DATA_ERROR;
+
+    memset(bits, 0, 19);
+    for (uint8_t i = 0; i < ncode; i++)
+      bits[order[i]] = inflateBits(s, 3);
+    if (s.overrun)
+      return AsyncInflater::DATA_ERROR;
+    inflateBuildTree(lengths, bits, 19);
+
+    // code lengths of both trees, 16 to 18 repeat the previous length or zeros
+    uint16_t index = 0;
+    while (index < nlen + ndist) {
+      int symbol = inflateSymbol(s, lengths);
+      if (symbol < 0)
+        return AsyncInflater::DATA_ERROR;
+      if (symbol < 16) {
+        bits[index++] = symbol;
+        continue;
+      }
+      uint8_t len = 0;
+      uint8_t repeat;
+      if (symbol == 16) {
+        if (!index)
+          return AsyncInflater::DATA_ERROR;
+        len = bits[index - 1];
+        repeat = 3 + inflateBits(s, 2);
+      } else if (symbol == 17) {
+        repeat = 3 + inflateBits(s, 3);
+      } else {
+        repeat = 11 + inflateBits(s, 7);
+      }
+      if (s.overrun || index + repeat > nlen + ndist)
+        return AsyncInflater::DATA_ERROR;
+      memset(bits + index, len, repeat);
+      index += repeat;
+    }
+    if (!bits[GZIP_END_OF_BLOCK])
+      return AsyncInflater::DATA_ERROR;
+
+    inflateBuildTree(lengths, bits, nlen);
+    inflateBuildTree(distances, bits + nlen, ndist);
+    return inflateCodes(s, lengths, distances);
+  }
+} // namespace
+
+AsyncInflater::Result AsyncInflater::inflate(const uint8_t* in, size_t inLen, uint8_t* out, size_t outSize, size_t& outLen) {
+  InflateState s = {in, inLen, 0, 0, 0, false, out, outSize, 0};
+  Result result = OK;
+  bool final = false;
+  // a sync flush ends the data on a byte boundary without a final block
+  while (!final && result == OK && s.inPos < s.inLen) {
+    final = inflateBits(s, 1);
+    uint8_t type = inflateBits(s, 2);
+    if (s.overrun)
+      result = DATA_ERROR;
+    else if (type == 0)
+      result = inflateStored(s);
+    else if (type == 1)
+      result = inflateFixed(s);
+    else if (type == 2)
+      result = inflateDynamic(s);
+    else
+      result = DATA_ERROR;
+  }
+  outLen = s.outLen;
+  return result;
+}
@@ -0,0 +1,136 @@
+#ifndef ASYNCGZIP_H_
+#define ASYNCGZIP_H_
+
+#include <Arduino.h>
+#include <atomic>
+
+// compression level, from 1 (fastest) to 9 (smallest output)
+#ifndef ASYNC_GZIP_LEVEL
+  #define ASYNC_GZIP_LEVEL 4
+#endif
+// size of the sliding window as a power of two (9 to 14), an encoder uses 5 << windowBits bytes
+#ifndef ASYNC_GZIP_WINDOW_BITS
+  #define ASYNC_GZIP_WINDOW_BITS 10
+#endif
+// memory all encoders alive at the same time may use, responses beyond it are sent uncompressed
+#ifndef ASYNC_GZIP_MAX_MEMORY
+  #define ASYNC_GZIP_MAX_MEMORY (16 * 1024)
+#endif
+
+/**
+ * @brief Streaming gzip encoder with bounded memory
+ * Deflates with fixed Huffman codes over a small LZ77 window, so the whole state is memoryUsage(windowBits) bytes,
+ * allocated by begin() and released by the destructor.
+ * Raw data is written straight into the encoder window with inputBuffer() and commit(),
+ * finish() marks the end of the input and compressed data is pulled with read().
+ * In raw mode the deflate data has no gzip header and trailer and ends with a sync flush
+ * whose trailing 00 00 FF FF bytes are left out, the message format of websocket permessage-deflate (RFC 7692).
+ */
+class AsyncGzipEncoder {
+  public:
+    AsyncGzipEncoder(uint8_t level = ASYNC_GZIP_LEVEL, uint8_t windowBits = ASYNC_GZIP_WINDOW_BITS, bool raw = false);
+    ~AsyncGzipEncoder();
+
+    AsyncGzipEncoder(AsyncGzipEncoder const&) = delete;
+    AsyncGzipEncoder& operator=(AsyncGzipEncoder const&) = delete;
+
+    /**
+     * @brief allocate the encoder state, within the memory all encoders may use together
+     * @return false if memory could not be allocated or the encoders alive would use more than maxMemory
+     */
+    bool begin(size_t maxMemory = ASYNC_GZIP_MAX_MEMORY);
+
+    /**
+     * @brief get where the next raw bytes have to be written
+     *
+     * @param len set to the number of bytes that can be written
+     * @return uint8_t* nullptr if no input can be accepted until more output is read
+     */
+    uint8_t* inputBuffer(size_t& len);
+
+    /**
+     * @brief account for len bytes written to inputBuffer()
+     */
+    void commit(size_t len);
+
+    /**
+     * @brief mark the end of the input
+     */
+    void finish() { _inputEnd = true; }
+
+    /**
+     * @brief read compressed data
+     * @return size_t number of bytes written to out, 0 if more input is needed or the stream is complete
+     */
+    size_t read(uint8_t* out, size_t len);
+
+    bool finished() const { return _inputEnd; }
+    bool done() const { return _state == STATE_DONE && _pendingPos == _pendingLen; }
+
+    static size_t memoryUsage(uint8_t windowBits);
+    // memory used by all the encoders currently allocated
+    static size_t memoryInUse() { return _memoryInUse; }
+
+  private:
+    enum State : uint8_t {
+      STATE_HEADER,
+      STATE_BODY,
+      STATE_TRAILER,
+      STATE_DONE
+    };
+
+    uint8_t _windowBits;
+    bool _raw;
+    uint16_t _maxChain;
+    size_t _wsize;
+    uint8_t* _window{nullptr};
+    uint16_t* _prev{nullptr};
+    uint16_t* _head{nullptr};
+    size_t _pos{0};
+    size_t _windowLen{0};
+    bool _inputEnd{false};
+    State _state{STATE_HEADER};
+    uint32_t _crc{0xFFFFFFFF};
+    uint32_t _inputSize{0};
+    uint32_t _bits{0};
+    uint8_t _bitCount{0};
+    uint8_t _pending[16];
+    uint8_t _pendingLen{0};
+    uint8_t _pendingPos{0};
+
+    static std::atomic<size_t> _memoryInUse;
+
+    bool _step();
+    void _slide();
+    uint32_t _hash(size_t pos) const;
+    void _insert(size_t pos);
+    size_t _longestMatch(size_t pos, size_t maxLen, size_t& distance) const;
+    void _putBits(uint32_t value, uint8_t count);
+    void _putSymbol(uint16_t symbol);
+    void _putMatch(size_t length, size_t distance);
+    void _putByte(uint8_t value) { _pending[_pendingLen++] = value; }
+};
+
+/**
+ * @brief Raw deflate decoder for whole messages
+ * The output buffer is the history window, so nothing is allocated: the Huffman tables live on the stack
+ * and decoding fails once the output would not fit in outSize bytes.
+ */
+class AsyncInflater {
+  public:
+    enum Result : uint8_t {
+      OK,
+      DATA_ERROR,
+      OUTPUT_FULL
+    };
+
+    /**
+     * @brief inflate deflate blocks until the final block or until the input ends after a block,
+     * a permessage-deflate message needs its 00 00 FF FF tail appended back
+     *
+     * @param outLen set to the number of bytes written to out
+     */
+    static Result inflate(const uint8_t* in, size_t inLen, uint8_t* out, size_t outSize, size_t& outLen);
+};
+
+#endif /* ASYNCGZIP_H_ */
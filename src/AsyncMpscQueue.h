@@ -0,0 +1,100 @@
+#ifndef ASYNCMPSCQUEUE_H_
+#define ASYNCMPSCQUEUE_H_
+
+#include <atomic>
+#include <stddef.h>
+#include <utility>
+
+/**
+ * @brief Bounded queue handing items from any number of tasks over to the network task
+ * push() never blocks and takes no lock: a producer claims a slot with a compare and swap on the tail,
+ * retried only when another producer claimed the same slot in between, and publishes it with the slot sequence number.
+ * drain() is the single consumer, a call made while another one runs returns right away.
+ * The N slots are part of the object, items are moved in and out.
+ */
+template <typename T, size_t N>
+class AsyncMpscQueue {
+    static_assert(N >= 2 && (N & (N - 1)) == 0, "AsyncMpscQueue size must be a power of two");
+
+  private:
+    struct Slot {
+        // index the slot is free for when equal to its position, holds the item pushed at seq - 1 otherwise
+        std::atomic<size_t> seq;
+        T item;
+    };
+    Slot _slots[N];
+    std::atomic<size_t> _tail{0};
+    // only written by drain(), read by pending() from any task
+    std::atomic<size_t> _head{0};
+    std::atomic<bool> _draining{false};
+
+  public:
+    AsyncMpscQueue() {
+      for (size_t i = 0; i < N; i++)
+        _slots[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    AsyncMpscQueue(AsyncMpscQueue const&) = delete;
+    AsyncMpscQueue& operator=(AsyncMpscQueue const&) = delete;
+
+    /**
+     * @brief add an item, from any task or core
+     * @return false if the queue is full, the item is then left untouched
+     */
+    bool push(T&& item) {
+      size_t pos = _tail.load(std::memory_order_relaxed);
+      Slot* slot;
+      for (;;) {
+        slot = &_slots[pos & (N - 1)];
+        size_t seq = slot->seq.load(std::memory_order_acquire);
+        if (seq == pos) {
+          if (_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+            break;
+        } else if ((ptrdiff_t)(seq - pos) < 0) {
+          // the slot still holds the item pushed N positions earlier
+          return false;
+        } else {
+          pos = _tail.load(std::memory_order_relaxed);
+        }
+      }
+      slot->item = std::move(item);
+      slot->seq.store(pos + 1, std::memory_order_release);
+      return true;
+    }
+
+    /**
+     * @brief whether an item waits to be drained, from any task
+     * an item pushed concurrently may not be seen yet
+     */
+    bool pending() const {
+      const size_t head = _head.load(std::memory_order_acquire);
+      return _slots[head & (N - 1)].seq.load(std::memory_order_acquire) == head + 1;
+    }
+
+    /**
+     * @brief hand the queued items to f in push order, at most N per call so producers cannot hold the consumer
+     * @return number of items handed over
+     */
+    template <typename F>
+    size_t drain(F&& f) {
+      if (_draining.exchange(true, std::memory_order_acquire))
+        return 0;
+      size_t head = _head.load(std::memory_order_relaxed);
+      size_t count = 0;
+      while (count < N) {
+        Slot& slot = _slots[head & (N - 1)];
+        if (slot.seq.load(std::memory_order_acquire) != head + 1)
+          break;
+        T item = std::move(slot.item);
+        slot.item = T();
+        slot.seq.store(head + N, std::memory_order_release);
+        _head.store(++head, std::memory_order_release);
+        ++count;
+        f(item);
+      }
+      _draining.store(false, std::memory_order_release);
+      return count;
+    }
+};
+
+#endif /* ASYNCMPSCQUEUE_H_ */
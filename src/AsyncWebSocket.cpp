@@ -19,6 +19,7 @@
   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 */
 #include "AsyncWebSocket.h"
+#include "AsyncWebSocketMask.h"
 #include "Arduino.h"
 
 #include <cstring>
@@ -38,6 +39,12 @@
 
 using namespace asyncsrv;
 
+// size of a frame header, from its first two bytes
+static size_t webSocketHeaderLen(const uint8_t* header) {
+  uint8_t len = header[1] & 0x7F;
+  return 2 + (len == 126 ? 2 : (len == 127 ? 8 : 0)) + ((header[1] & 0x80) ? 4 : 0);
+}
+
 size_t webSocketSendFrameWindow(AsyncClient* client) {
   if (!client || !client->canSend())
     return 0;
@@ -47,7 +54,7 @@ size_t webSocketSendFrameWindow(AsyncClient* client) {
   return space - 8;
 }
 
-size_t webSocketSendFrame(AsyncClient* client, bool final, uint8_t opcode, bool mask, uint8_t* data, size_t len) {
+size_t webSocketSendFrame(AsyncClient* client, bool final, uint8_t opcode, bool mask, uint8_t* data, size_t len, bool deflated = false) {
   if (!client || !client->canSend()) {
     // Serial.println("SF 1");
     return 0;
@@ -77,16 +84,24 @@ size_t webSocketSendFrame(AsyncClient* client, bool final, uint8_t opcode, bool
   if (len > space)
     len = space;
 
-  uint8_t* buf = (uint8_t*)malloc(headLen);
-  if (buf == NULL) {
-    // os_printf("could not malloc %u bytes for frame header\n", headLen);
-    //  Serial.println("SF 3");
-    return 0;
+  // masked payload goes out of a borrowed send buffer so the message data, which may be shared, stays untouched
+  uint8_t* mdata = nullptr;
+  if (len && mask) {
+    mdata = AsyncSendBufferPool::Instance().acquire(len);
+    if (!mdata)
+      return 0;
+    webSocketMask(mdata, data, len, mbuf, 0);
   }
 
+  // a shortened payload may need a shorter length field
+  headLen = 2 + (len > 125 ? 2 : 0) + (len && mask ? 4 : 0);
+
+  uint8_t buf[8];
   buf[0] = opcode & 0x0F;
   if (final)
     buf[0] |= 0x80;
+  if (deflated)
+    buf[0] |= 0x40;
   if (len < 126)
     buf[1] = len & 0x7F;
   else {
@@ -100,19 +115,15 @@ size_t webSocketSendFrame(AsyncClient* client, bool final, uint8_t opcode, bool
   }
   if (client->add((const char*)buf, headLen) != headLen) {
     // os_printf("error adding %lu header bytes\n", headLen);
-    free(buf);
+    AsyncSendBufferPool::Instance().release(mdata);
     // Serial.println("SF 4");
     return 0;
   }
-  free(buf);
 
   if (len) {
-    if (len && mask) {
-      size_t i;
-      for (i = 0; i < len; i++)
-        data[i] = data[i] ^ mbuf[i % 4];
-    }
-    if (client->add((const char*)data, len) != len) {
+    size_t added = client->add((const char*)(mdata ? mdata : data), len);
+    AsyncSendBufferPool::Instance().release(mdata);
+    if (added != len) {
       // os_printf("error adding %lu data bytes\n", len);
       //  Serial.println("SF 5");
       return 0;
@@ -127,6 +138,50 @@ size_t webSocketSendFrame(AsyncClient* client, bool final, uint8_t opcode, bool
   return len;
 }
 
+/*
+ * Compress a message for permessage-deflate with no context takeover.
+ * Returns nullptr when it is too short, compression does not shrink it or the encoder can not be allocated.
+ */
+static AsyncWebSocketSharedBuffer webSocketDeflate(const uint8_t* data, size_t size, uint8_t windowBits) {
+  if (size < WS_DEFLATE_MIN_SIZE)
+    return nullptr;
+
+  AsyncGzipEncoder encoder(ASYNC_GZIP_LEVEL, windowBits, true);
+  if (!encoder.begin())
+    return nullptr;
+
+  // only worth sending if smaller than the original
+  auto out = std::make_shared<std::vector<uint8_t>>(size);
+  size_t in = 0;
+  size_t len = 0;
+  while (!encoder.done()) {
+    if (in < size) {
+      size_t avail;
+      uint8_t* dst = encoder.inputBuffer(avail);
+      if (dst) {
+        avail = std::min(avail, size - in);
+        memcpy(dst, data + in, avail);
+        encoder.commit(avail);
+        in += avail;
+      }
+    } else if (!encoder.finished()) {
+      encoder.finish();
+    }
+    if (len == size)
+      return nullptr;
+    len += encoder.read(out->data() + len, size - len);
+  }
+  if (len == size)
+    return nullptr;
+  out->resize(len);
+  return out;
+}
+
+// the bytes of a shared buffer, which stays alive as long as they are referenced
+static AsyncWebSocketSharedData webSocketSharedData(const AsyncWebSocketSharedBuffer& buffer) {
+  return AsyncWebSocketSharedData(buffer, buffer->data());
+}
+
 /*
  *    AsyncWebSocketMessageBuffer
  */
@@ -203,21 +258,51 @@ class AsyncWebSocketControl {
  * AsyncWebSocketMessage Message
  */
 
-AsyncWebSocketMessage::AsyncWebSocketMessage(AsyncWebSocketSharedBuffer buffer, uint8_t opcode, bool mask) : _WSbuffer{buffer},
-                                                                                                             _opcode(opcode & 0x07),
-                                                                                                             _mask{mask},
-                                                                                                             _status{_WSbuffer ? WS_MSG_SENDING : WS_MSG_ERROR} {
+AsyncWebSocketFrameHeader::AsyncWebSocketFrameHeader(uint8_t opcode, size_t payloadLen, bool deflated) {
+  data[0] = 0x80 | (deflated ? 0x40 : 0) | (opcode & 0x0F);
+  if (payloadLen < 126) {
+    data[1] = payloadLen;
+    len = 2;
+  } else if (payloadLen <= 0xFFFF) {
+    data[1] = 126;
+    data[2] = (uint8_t)((payloadLen >> 8) & 0xFF);
+    data[3] = (uint8_t)(payloadLen & 0xFF);
+    len = 4;
+  }
+}
+
+AsyncWebSocketMessage::AsyncWebSocketMessage(AsyncWebSocketSharedData data, size_t len, uint8_t opcode, bool mask, const AsyncWebSocketFrameHeader& header, bool deflated, std::shared_ptr<void> reservation, uint32_t key)
+    : _data{std::move(data)},
+      _len{_data ? len : 0},
+      _opcode(opcode & 0x07),
+      _mask{mask},
+      _status{_data ? WS_MSG_SENDING : WS_MSG_ERROR},
+      _header(mask ? AsyncWebSocketFrameHeader() : (header.len || !_data ? header : AsyncWebSocketFrameHeader(opcode, _len, deflated))),
+      _deflated{deflated},
+      _reservation{std::move(reservation)},
+      _key{key} {
 }
 
 void AsyncWebSocketMessage::ack(size_t len, uint32_t time) {
   (void)time;
   _acked += len;
-  if (_sent >= _WSbuffer->size() && _acked >= _ack) {
+  if (_sent >= _len && _acked >= _ack) {
     _status = WS_MSG_SENT;
   }
   // ets_printf("A: %u\n", len);
 }
 
+bool AsyncWebSocketMessage::add(AsyncClient* client) {
+  size_t len = frameLength();
+  if (!len || _status != WS_MSG_SENDING || client->space() < len)
+    return false;
+  if (client->add((const char*)_header.data, _header.len) != _header.len || client->add((const char*)_data.get(), _len) != _len)
+    return false;
+  _sent = _len;
+  _ack += len;
+  return true;
+}
+
 size_t AsyncWebSocketMessage::send(AsyncClient* client) {
   if (!client)
     return 0;
@@ -227,36 +312,53 @@ size_t AsyncWebSocketMessage::send(AsyncClient* client) {
   if (_acked < _ack) {
     return 0;
   }
-  if (_sent == _WSbuffer->size()) {
+  if (_sent == _len) {
     if (_acked == _ack)
       _status = WS_MSG_SENT;
     return 0;
   }
-  if (_sent > _WSbuffer->size()) {
+  if (_sent > _len) {
     _status = WS_MSG_ERROR;
-    // ets_printf("E: %u > %u\n", _sent, _WSbuffer->length());
+    // ets_printf("E: %u > %u\n", _sent, _len);
     return 0;
   }
 
-  size_t toSend = _WSbuffer->size() - _sent;
+  // the whole message fits in the socket: write the prebuilt header and the payload as one frame
+  if (client->canSend() && add(client)) {
+    client->send();
+    return _sent;
+  }
+
+  size_t toSend = _len - _sent;
   size_t window = webSocketSendFrameWindow(client);
 
   if (window < toSend) {
     toSend = window;
   }
 
+  // masked frames are built in a pooled send buffer, keep them within its size
+  AsyncSendBufferPool& pool = AsyncSendBufferPool::Instance();
+  if (_mask && pool.enabled() && toSend > pool.bufferSize()) {
+    toSend = pool.bufferSize();
+  }
+
+  const size_t frameLen = toSend + ((toSend < 126) ? 2 : 4) + (_mask * 4);
   _sent += toSend;
-  _ack += toSend + ((toSend < 126) ? 2 : 4) + (_mask * 4);
+  _ack += frameLen;
 
   // ets_printf("W: %u %u\n", _sent - toSend, toSend);
 
-  bool final = (_sent == _WSbuffer->size());
-  uint8_t* dPtr = (uint8_t*)(_WSbuffer->data() + (_sent - toSend));
+  bool final = (_sent == _len);
+  uint8_t* dPtr = (uint8_t*)(_data.get() + (_sent - toSend));
   uint8_t opCode = (toSend && _sent == toSend) ? _opcode : (uint8_t)WS_CONTINUATION;
 
-  size_t sent = webSocketSendFrame(client, final, opCode, _mask, dPtr, toSend);
+  size_t sent = webSocketSendFrame(client, final, opCode, _mask, dPtr, toSend, _deflated && opCode != WS_CONTINUATION);
   _status = WS_MSG_SENDING;
-  if (toSend && sent != toSend) {
+  if (toSend && !sent) {
+    // nothing written, e.g. no send buffer free for a masked frame: the frame header is not expected to be acked either
+    _sent -= toSend;
+    _ack -= frameLen;
+  } else if (toSend && sent != toSend) {
     // ets_printf("E: %u != %u\n", toSend, sent);
     _sent -= (toSend - sent);
     _ack -= (toSend - sent);
@@ -271,13 +373,17 @@ size_t AsyncWebSocketMessage::send(AsyncClient* client) {
 const char* AWSC_PING_PAYLOAD = "ESPAsyncWebServer-PING";
 const size_t AWSC_PING_PAYLOAD_LEN = 22;
 
-AsyncWebSocketClient::AsyncWebSocketClient(AsyncWebServerRequest* request, AsyncWebSocket* server)
+AsyncWebSocketClient::AsyncWebSocketClient(AsyncWebServerRequest* request, AsyncWebSocket* server, uint8_t deflateBits)
     : _tempObject(NULL) {
   _client = request->client();
   _server = server;
   _clientId = _server->_getNextId();
   _status = WS_CONNECTED;
   _pstate = 0;
+  _headerLen = 0;
+  _deflateBits = deflateBits;
+  _inflating = false;
+  _inflateDiscard = false;
   _lastMessageTime = millis();
   _keepAlivePeriod = 0;
   _client->setRxTimeout(0);
@@ -303,12 +409,16 @@ AsyncWebSocketClient::~AsyncWebSocketClient() {
 }
 
 void AsyncWebSocketClient::_clearQueue() {
-  while (!_messageQueue.empty() && _messageQueue.front().finished())
+  while (!_messageQueue.empty() && _messageQueue.front().finished()) {
+    _queuedBytes -= _messageQueue.front().length();
     _messageQueue.pop_front();
+  }
 }
 
 void AsyncWebSocketClient::_onAck(size_t len, uint32_t time) {
   _lastMessageTime = millis();
+  // queued before taking the lock, which queueing them takes
+  _server->_runPosted();
 
 #ifdef ESP32
   std::lock_guard<std::mutex> lock(_lock);
@@ -329,8 +439,15 @@ void AsyncWebSocketClient::_onAck(size_t len, uint32_t time) {
     }
   }
 
-  if (len && !_messageQueue.empty()) {
-    _messageQueue.front().ack(len, time);
+  // a batch is acknowledged across its messages, in queue order
+  for (auto it = _messageQueue.begin(); len && it != _messageQueue.end(); ++it) {
+    size_t n = std::min(len, it->unacked());
+    auto next = std::next(it);
+    // whatever is left belongs to the last message in flight
+    if (next == _messageQueue.end() || !next->unacked())
+      n = len;
+    it->ack(n, time);
+    len -= n;
   }
 
   _clearQueue();
@@ -342,6 +459,8 @@ void AsyncWebSocketClient::_onPoll() {
   if (!_client)
     return;
 
+  _server->_runPosted();
+
 #ifdef ESP32
   std::unique_lock<std::mutex> lock(_lock);
 #endif
@@ -365,15 +484,55 @@ void AsyncWebSocketClient::_runQueue() {
   if (!_controlQueue.empty() && (_messageQueue.empty() || _messageQueue.front().betweenFrames()) && webSocketSendFrameWindow(_client) > (size_t)(_controlQueue.front().len() - 1)) {
     _controlQueue.front().send(_client);
   } else if (!_messageQueue.empty() && _messageQueue.front().betweenFrames() && webSocketSendFrameWindow(_client)) {
-    _messageQueue.front().send(_client);
+    if (!_server->batchSize() || !_runBatch())
+      _messageQueue.front().send(_client);
+  } else if (!_messageQueue.empty() && _messageQueue.front().written() && _server->batchSize()) {
+    _runBatch();
   }
 }
 
+bool AsyncWebSocketClient::_runBatch() {
+  // messages written whole wait for their ack, the batch may follow them
+  auto first = _messageQueue.begin();
+  while (first != _messageQueue.end() && first->written())
+    ++first;
+  const bool inFlight = first != _messageQueue.begin();
+
+  // following messages that are written whole and fit in the batch and the socket
+  const size_t limit = std::min(_server->batchSize(), _client->space());
+  size_t count = 0;
+  size_t bytes = 0;
+  bool more = false;
+  for (auto it = first; it != _messageQueue.end(); ++it) {
+    size_t len = it->frameLength();
+    if (!len || bytes + len > limit) {
+      more = true;
+      break;
+    }
+    bytes += len;
+    count++;
+  }
+
+  if (inFlight) {
+    // the ack of the data in flight runs the queue again: wait for it while the batch can still grow
+    const uint32_t delay = _server->batchDelay();
+    if (!count || (!more && bytes < _server->batchSize() && (!delay || millis() - _batchTime < delay)))
+      return true;
+  } else if (count < 2) {
+    return false;
+  }
+
+  for (auto it = first; count--; ++it)
+    it->add(_client);
+  _client->send();
+  return true;
+}
+
 bool AsyncWebSocketClient::queueIsFull() const {
 #ifdef ESP32
   std::lock_guard<std::mutex> lock(_lock);
 #endif
-  return (_messageQueue.size() >= WS_MAX_QUEUED_MESSAGES) || (_status != WS_CONNECTED);
+  return (_messageQueue.size() >= WS_MAX_QUEUED_MESSAGES) || (_queuedBytes >= _server->maxQueuedBytes()) || (_status != WS_CONNECTED);
 }
 
 size_t AsyncWebSocketClient::queueLen() const {
@@ -383,11 +542,18 @@ size_t AsyncWebSocketClient::queueLen() const {
   return _messageQueue.size();
 }
 
+size_t AsyncWebSocketClient::queuedBytes() const {
+#ifdef ESP32
+  std::lock_guard<std::mutex> lock(_lock);
+#endif
+  return _queuedBytes;
+}
+
 bool AsyncWebSocketClient::canSend() const {
 #ifdef ESP32
   std::lock_guard<std::mutex> lock(_lock);
 #endif
-  return _messageQueue.size() < WS_MAX_QUEUED_MESSAGES;
+  return _messageQueue.size() < WS_MAX_QUEUED_MESSAGES && _queuedBytes < _server->maxQueuedBytes();
 }
 
 bool AsyncWebSocketClient::_queueControl(uint8_t opcode, const uint8_t* data, size_t len, bool mask) {
@@ -406,15 +572,42 @@ bool AsyncWebSocketClient::_queueControl(uint8_t opcode, const uint8_t* data, si
   return true;
 }
 
-bool AsyncWebSocketClient::_queueMessage(AsyncWebSocketSharedBuffer buffer, uint8_t opcode, bool mask) {
-  if (!_client || buffer->size() == 0 || _status != WS_CONNECTED)
+bool AsyncWebSocketClient::_queueData(AsyncWebSocketSharedBuffer buffer, uint8_t opcode, uint32_t key) {
+  return buffer && _queueData(webSocketSharedData(buffer), buffer->size(), opcode, key);
+}
+
+bool AsyncWebSocketClient::_queueData(AsyncWebSocketSharedData data, size_t len, uint8_t opcode, uint32_t key) {
+  // compressed for this client only: a smaller window bounds the encoder allocated on the caller task
+  AsyncWebSocketSharedBuffer deflated = _deflateBits && data ? webSocketDeflate(data.get(), len, std::min(_deflateBits, (uint8_t)WS_DEFLATE_CLIENT_WINDOW_BITS)) : nullptr;
+  if (!deflated)
+    return _queueMessage(std::move(data), len, opcode, false, AsyncWebSocketFrameHeader(), false, nullptr, key);
+  return _queueMessage(webSocketSharedData(deflated), deflated->size(), opcode, false, AsyncWebSocketFrameHeader(opcode, deflated->size(), true), true, nullptr, key);
+}
+
+bool AsyncWebSocketClient::_queueMessage(AsyncWebSocketSharedData data, size_t len, uint8_t opcode, bool mask, const AsyncWebSocketFrameHeader& header, bool deflated, std::shared_ptr<void> reservation, uint32_t key) {
+  if (!_client || !data || len == 0 || _status != WS_CONNECTED)
     return false;
 
+  if (!reservation) {
+    reservation = _server->_reserve(len);
+    if (!reservation)
+      return false;
+  }
+
 #ifdef ESP32
   std::lock_guard<std::mutex> lock(_lock);
 #endif
 
-  if (_messageQueue.size() >= WS_MAX_QUEUED_MESSAGES) {
+  // a keyed message takes the place of a queued one with the same key that is not being sent yet
+  auto replaced = _messageQueue.end();
+  if (key)
+    replaced = std::find_if(_messageQueue.begin(), _messageQueue.end(), [key](const AsyncWebSocketMessage& m) { return m.key() == key && !m.started(); });
+  const bool replacing = replaced != _messageQueue.end();
+  const size_t queuedBytes = _queuedBytes - (replacing ? replaced->length() : 0);
+  const size_t queued = _messageQueue.size() - (replacing ? 1 : 0);
+
+  // an empty queue takes a message of any size, so that it can be sent at all
+  if (queued >= WS_MAX_QUEUED_MESSAGES || (queued && queuedBytes + len > _server->maxQueuedBytes())) {
     if (closeWhenFull) {
       _status = WS_DISCONNECTED;
 
@@ -438,7 +631,13 @@ bool AsyncWebSocketClient::_queueMessage(AsyncWebSocketSharedBuffer buffer, uint
     return false;
   }
 
-  _messageQueue.emplace_back(buffer, opcode, mask);
+  if (!_messageQueue.size() || _messageQueue.back().started())
+    _batchTime = millis();
+  if (replacing)
+    *replaced = AsyncWebSocketMessage(std::move(data), len, opcode, mask, header, deflated, std::move(reservation), key);
+  else
+    _messageQueue.emplace_back(std::move(data), len, opcode, mask, header, deflated, std::move(reservation), key);
+  _queuedBytes = queuedBytes + len;
 
   if (_client && _client->canSend())
     _runQueue();
@@ -501,7 +700,30 @@ void AsyncWebSocketClient::_onData(void* pbuf, size_t plen) {
   uint8_t* data = (uint8_t*)pbuf;
   while (plen > 0) {
     if (!_pstate) {
-      const uint8_t* fdata = data;
+      // the frame header may be split across segments: gather it before parsing
+      size_t headerLen = _headerLen < 2 ? 2 : webSocketHeaderLen(_header);
+      while (_headerLen < headerLen && plen) {
+        _header[_headerLen++] = *data++;
+        plen--;
+        if (_headerLen == 2)
+          headerLen = webSocketHeaderLen(_header);
+      }
+      // a masked close frame split after its first two bytes waits for its mask key like any other split header
+      if (_headerLen < headerLen)
+        return;
+      const uint8_t* fdata = _header;
+      _headerLen = 0;
+
+      // RSV1 flags the first frame of a permessage-deflate message
+      if (fdata[0] & 0x40) {
+        if (!_deflateBits || _inflating || (fdata[0] & 0x0F) == WS_CONTINUATION || (fdata[0] & 0x0F) >= WS_DISCONNECT) {
+          close(1002);
+          return;
+        }
+        _inflating = true;
+        _inflateDiscard = false;
+        _pinfo.message_opcode = fdata[0] & 0x0F;
+      }
 
       _pinfo.index = 0;
       _pinfo.final = (fdata[0] & 0x80) != 0;
@@ -513,34 +735,21 @@ void AsyncWebSocketClient::_onData(void* pbuf, size_t plen) {
       // log_d("WS[%" PRIu32 "]: _status = %" PRIu32, _clientId, _status);
       // log_d("WS[%" PRIu32 "]: _pinfo: index: %" PRIu64 ", final: %" PRIu8 ", opcode: %" PRIu8 ", masked: %" PRIu8 ", len: %" PRIu64, _clientId, _pinfo.index, _pinfo.final, _pinfo.opcode, _pinfo.masked, _pinfo.len);
 
-      data += 2;
-      plen -= 2;
-
-      if (_pinfo.len == 126 && plen >= 2) {
+      if (_pinfo.len == 126) {
         _pinfo.len = fdata[3] | (uint16_t)(fdata[2]) << 8;
-        data += 2;
-        plen -= 2;
-
-      } else if (_pinfo.len == 127 && plen >= 8) {
+      } else if (_pinfo.len == 127) {
         _pinfo.len = fdata[9] | (uint16_t)(fdata[8]) << 8 | (uint32_t)(fdata[7]) << 16 | (uint32_t)(fdata[6]) << 24 | (uint64_t)(fdata[5]) << 32 | (uint64_t)(fdata[4]) << 40 | (uint64_t)(fdata[3]) << 48 | (uint64_t)(fdata[2]) << 56;
-        data += 8;
-        plen -= 8;
       }
 
-      if (_pinfo.masked && plen >= 4) { // if ws.close() is called, Safari sends a close frame with plen 2 and masked bit set. We must not decrement plen which is already 0.
-        memcpy(_pinfo.mask, data, 4);
-        data += 4;
-        plen -= 4;
-      }
+      if (_pinfo.masked)
+        memcpy(_pinfo.mask, fdata + headerLen - 4, 4);
     }
 
     const size_t datalen = std::min((size_t)(_pinfo.len - _pinfo.index), plen);
     const auto datalast = data[datalen];
 
-    if (_pinfo.masked) {
-      for (size_t i = 0; i < datalen; i++)
-        data[i] ^= _pinfo.mask[(_pinfo.index + i) % 4];
-    }
+    if (_pinfo.masked)
+      webSocketMask(data, data, datalen, _pinfo.mask, _pinfo.index);
 
     if ((datalen + _pinfo.index) < _pinfo.len) {
       _pstate = 1;
@@ -551,8 +760,12 @@ void AsyncWebSocketClient::_onData(void* pbuf, size_t plen) {
           _pinfo.num = 0;
         }
       }
-      if (datalen > 0)
-        _server->_handleEvent(this, WS_EVT_DATA, (void*)&_pinfo, data, datalen);
+      if (datalen > 0) {
+        if (_inflating && _pinfo.opcode < WS_DISCONNECT)
+          _inflateAppend(data, datalen);
+        else
+          _server->_handleEvent(this, WS_EVT_DATA, (void*)&_pinfo, data, datalen);
+      }
 
       _pinfo.index += datalen;
     } else if ((datalen + _pinfo.index) == _pinfo.len) {
@@ -582,7 +795,13 @@ void AsyncWebSocketClient::_onData(void* pbuf, size_t plen) {
         if (datalen != AWSC_PING_PAYLOAD_LEN || memcmp(AWSC_PING_PAYLOAD, data, AWSC_PING_PAYLOAD_LEN) != 0)
           _server->_handleEvent(this, WS_EVT_PONG, NULL, NULL, 0);
       } else if (_pinfo.opcode < WS_DISCONNECT) { // continuation or text/binary frame
-        _server->_handleEvent(this, WS_EVT_DATA, (void*)&_pinfo, data, datalen);
+        if (_inflating) {
+          _inflateAppend(data, datalen);
+          if (_pinfo.final)
+            _inflateMessage();
+        } else {
+          _server->_handleEvent(this, WS_EVT_DATA, (void*)&_pinfo, data, datalen);
+        }
         if (_pinfo.final)
           _pinfo.num = 0;
         else
@@ -603,6 +822,57 @@ void AsyncWebSocketClient::_onData(void* pbuf, size_t plen) {
   }
 }
 
+bool AsyncWebSocketClient::_inflateAppend(const uint8_t* data, size_t len) {
+  if (_inflateDiscard)
+    return false;
+  if (_inflateInput.size() + len > _server->deflateMaxMessageSize()) {
+    // the rest of the message is dropped as it arrives
+    _inflateDiscard = true;
+    std::vector<uint8_t>().swap(_inflateInput);
+    close(1009);
+    return false;
+  }
+  _inflateInput.insert(_inflateInput.end(), data, data + len);
+  return true;
+}
+
+void AsyncWebSocketClient::_inflateMessage() {
+  _inflating = false;
+  if (_inflateDiscard)
+    return;
+
+  static const uint8_t tail[4] = {0x00, 0x00, 0xFF, 0xFF};
+  _inflateInput.insert(_inflateInput.end(), tail, tail + sizeof(tail));
+
+  // inflated once into the largest message allowed, one more byte for the null terminator event handlers may add
+  const size_t maxLen = _server->deflateMaxMessageSize();
+  uint8_t* out = (uint8_t*)malloc(maxLen + 1);
+  size_t len = 0;
+  AsyncInflater::Result result = out ? AsyncInflater::inflate(_inflateInput.data(), _inflateInput.size(), out, maxLen, len) : AsyncInflater::OUTPUT_FULL;
+  std::vector<uint8_t>().swap(_inflateInput);
+
+  if (result != AsyncInflater::OK) {
+    free(out);
+#ifdef ESP8266
+    ets_printf("AsyncWebSocketClient::_inflateMessage: Cannot inflate message: closing connection\n");
+#elif defined(ESP32)
+    log_e("Cannot inflate message: closing connection");
+#endif
+    close(result == AsyncInflater::OUTPUT_FULL ? 1009 : 1007);
+    return;
+  }
+
+  // handlers get the message as a single frame
+  AwsFrameInfo info = _pinfo;
+  info.opcode = info.message_opcode;
+  info.num = 0;
+  info.final = 1;
+  info.index = 0;
+  info.len = len;
+  _server->_handleEvent(this, WS_EVT_DATA, (void*)&info, out, len);
+  free(out);
+}
+
 size_t AsyncWebSocketClient::printf(const char* format, ...) {
   va_list arg;
   va_start(arg, format);
@@ -669,7 +939,7 @@ bool AsyncWebSocketClient::text(AsyncWebSocketMessageBuffer* buffer) {
 }
 
 bool AsyncWebSocketClient::text(AsyncWebSocketSharedBuffer buffer) {
-  return _queueMessage(buffer);
+  return _queueData(buffer, WS_TEXT);
 }
 
 bool AsyncWebSocketClient::text(const uint8_t* message, size_t len) {
@@ -721,7 +991,7 @@ bool AsyncWebSocketClient::binary(AsyncWebSocketMessageBuffer* buffer) {
 }
 
 bool AsyncWebSocketClient::binary(AsyncWebSocketSharedBuffer buffer) {
-  return _queueMessage(buffer, WS_BINARY);
+  return _queueData(buffer, WS_BINARY);
 }
 
 bool AsyncWebSocketClient::binary(const uint8_t* message, size_t len) {
@@ -740,6 +1010,47 @@ bool AsyncWebSocketClient::binary(const String& message) {
   return binary(message.c_str(), message.length());
 }
 
+bool AsyncWebSocketClient::subscribe(const String& topic) {
+  return _server->subscribe(_clientId, topic);
+}
+
+bool AsyncWebSocketClient::unsubscribe(const String& topic) {
+  return _server->unsubscribe(_clientId, topic);
+}
+
+bool AsyncWebSocketClient::textLatest(uint32_t key, AsyncWebSocketSharedBuffer buffer) {
+  return _queueData(buffer, WS_TEXT, key);
+}
+
+bool AsyncWebSocketClient::textLatest(uint32_t key, const char* message, size_t len) {
+  return textLatest(key, makeSharedBuffer((const uint8_t*)message, len));
+}
+
+bool AsyncWebSocketClient::textLatest(uint32_t key, const String& message) {
+  return textLatest(key, message.c_str(), message.length());
+}
+
+bool AsyncWebSocketClient::text(AsyncWebSocketSharedData data, size_t len) {
+  return _queueData(std::move(data), len, WS_TEXT);
+}
+
+bool AsyncWebSocketClient::binary(AsyncWebSocketSharedData data, size_t len) {
+  return _queueData(std::move(data), len, WS_BINARY);
+}
+
+void AsyncWebSocketClient::message(AsyncWebSocketSharedBuffer buffer, uint8_t opcode, bool mask) {
+  if (buffer)
+    _queueMessage(webSocketSharedData(buffer), buffer->size(), opcode, mask);
+}
+
+bool AsyncWebSocketClient::binaryLatest(uint32_t key, AsyncWebSocketSharedBuffer buffer) {
+  return _queueData(buffer, WS_BINARY, key);
+}
+
+bool AsyncWebSocketClient::binaryLatest(uint32_t key, const uint8_t* message, size_t len) {
+  return binaryLatest(key, makeSharedBuffer(message, len));
+}
+
 #ifdef ESP8266
 bool AsyncWebSocketClient::binary(const __FlashStringHelper* data, size_t len) {
   PGM_P p = reinterpret_cast<PGM_P>(data);
@@ -773,26 +1084,65 @@ uint16_t AsyncWebSocketClient::remotePort() const {
  */
 
 void AsyncWebSocket::_handleEvent(AsyncWebSocketClient* client, AwsEventType type, void* arg, uint8_t* data, size_t len) {
+  if (type == WS_EVT_DATA && _topicCommands && _handleTopicCommand(client, (AwsFrameInfo*)arg, data, len))
+    return;
   if (_eventHandler != NULL) {
     _eventHandler(this, client, type, arg, data, len);
   }
 }
 
-AsyncWebSocketClient* AsyncWebSocket::_newClient(AsyncWebServerRequest* request) {
-  _clients.emplace_back(request, this);
+AsyncWebSocketClient* AsyncWebSocket::_newClient(AsyncWebServerRequest* request, uint8_t deflateBits) {
+  // messages posted before the client connected are not for it, they would arrive stale
+  _runPosted();
+  _clients.emplace_back(request, this, deflateBits);
+  {
+#ifdef ESP32
+    std::lock_guard<std::mutex> lock(_lock);
+#endif
+    _clientIndex[_clients.back().id()] = &_clients.back();
+  }
   _handleEvent(&_clients.back(), WS_EVT_CONNECT, request, NULL, 0);
   return &_clients.back();
 }
 
+std::shared_ptr<void> AsyncWebSocket::_reserve(size_t len) {
+  size_t queued = _queuedBytes.load();
+  do {
+    if (queued && queued + len > _maxQueuedBytesTotal) {
+#ifdef ESP8266
+      ets_printf("AsyncWebSocket::_reserve: Too many bytes queued: discarding new message\n");
+#elif defined(ESP32)
+      log_e("Too many bytes queued: discarding new message");
+#endif
+      return nullptr;
+    }
+  } while (!_queuedBytes.compare_exchange_weak(queued, queued + len));
+  // the bytes are given back when the last message holding the reservation is destroyed
+  return std::shared_ptr<void>(&_queuedBytes, [len](std::atomic<size_t>* queuedBytes) { *queuedBytes -= len; });
+}
+
+void AsyncWebSocket::enableDeflate(uint8_t windowBits, size_t maxMessageSize) {
+  _deflateWindowBits = std::max((uint8_t)9, std::min(windowBits, (uint8_t)14));
+  // the inflate buffer needs a bound, 0 keeps the default
+  _deflateMaxMessageSize = maxMessageSize ? maxMessageSize : WS_DEFLATE_MAX_MESSAGE_SIZE;
+}
+
 bool AsyncWebSocket::availableForWriteAll() {
   return std::none_of(std::begin(_clients), std::end(_clients), [](const AsyncWebSocketClient& c) { return c.queueIsFull(); });
 }
 
 bool AsyncWebSocket::availableForWrite(uint32_t id) {
-  const auto iter = std::find_if(std::begin(_clients), std::end(_clients), [id](const AsyncWebSocketClient& c) { return c.id() == id; });
-  if (iter == std::end(_clients))
-    return true;
-  return !iter->queueIsFull();
+  AsyncWebSocketClient* c;
+  {
+#ifdef ESP32
+    std::lock_guard<std::mutex> lock(_lock);
+#endif
+    const auto iter = _clientIndex.find(id);
+    if (iter == _clientIndex.end())
+      return true;
+    c = iter->second;
+  }
+  return !c->queueIsFull();
 }
 
 size_t AsyncWebSocket::count() const {
@@ -800,11 +1150,99 @@ size_t AsyncWebSocket::count() const {
 }
 
 AsyncWebSocketClient* AsyncWebSocket::client(uint32_t id) {
-  const auto iter = std::find_if(_clients.begin(), _clients.end(), [id](const AsyncWebSocketClient& c) { return c.id() == id && c.status() == WS_CONNECTED; });
-  if (iter == std::end(_clients))
+#ifdef ESP32
+  std::lock_guard<std::mutex> lock(_lock);
+#endif
+  const auto iter = _clientIndex.find(id);
+  if (iter == _clientIndex.end() || iter->second->status() != WS_CONNECTED)
     return nullptr;
 
-  return &(*iter);
+  return iter->second;
+}
+
+bool AsyncWebSocket::subscribe(uint32_t id, const String& topic) {
+  if (!client(id))
+    return false;
+#ifdef ESP32
+  std::lock_guard<std::mutex> lock(_lock);
+#endif
+  auto& ids = _topics[topic];
+  if (std::find(ids.begin(), ids.end(), id) == ids.end())
+    ids.push_back(id);
+  return true;
+}
+
+bool AsyncWebSocket::unsubscribe(uint32_t id, const String& topic) {
+#ifdef ESP32
+  std::lock_guard<std::mutex> lock(_lock);
+#endif
+  auto iter = _topics.find(topic);
+  if (iter == _topics.end())
+    return false;
+  auto& ids = iter->second;
+  auto sub = std::find(ids.begin(), ids.end(), id);
+  if (sub == ids.end())
+    return false;
+  ids.erase(sub);
+  if (ids.empty())
+    _topics.erase(iter);
+  return true;
+}
+
+size_t AsyncWebSocket::subscribers(const String& topic) const {
+#ifdef ESP32
+  std::lock_guard<std::mutex> lock(_lock);
+#endif
+  auto iter = _topics.find(topic);
+  return iter == _topics.end() ? 0 : iter->second.size();
+}
+
+AsyncWebSocket::SendStatus AsyncWebSocket::publish(const String& topic, AsyncWebSocketSharedBuffer buffer, AwsFrameType type) {
+  // the subscribers are copied so that no lock is held while messages are queued
+  std::vector<uint32_t> ids;
+  {
+#ifdef ESP32
+    std::lock_guard<std::mutex> lock(_lock);
+#endif
+    auto iter = _topics.find(topic);
+    if (iter == _topics.end())
+      return DISCARDED;
+    ids = iter->second;
+  }
+  return _sendAll(buffer, type, 0, &ids);
+}
+
+AsyncWebSocket::SendStatus AsyncWebSocket::publish(const String& topic, const uint8_t* message, size_t len, AwsFrameType type) {
+  return subscribers(topic) ? publish(topic, makeSharedBuffer(message, len), type) : DISCARDED;
+}
+
+AsyncWebSocket::SendStatus AsyncWebSocket::publish(const String& topic, const String& message) {
+  return publish(topic, (const uint8_t*)message.c_str(), message.length());
+}
+
+bool AsyncWebSocket::_handleTopicCommand(AsyncWebSocketClient* client, const AwsFrameInfo* info, const uint8_t* data, size_t len) {
+  // only whole text messages
+  if (info->opcode != WS_TEXT || !info->final || info->index || info->len != len)
+    return false;
+  const char* text = (const char*)data;
+  const size_t subLen = strlen(T_subscribe_);
+  const size_t unsubLen = strlen(T_unsubscribe_);
+  String topic;
+  if (len > subLen && !strncmp(text, T_subscribe_, subLen)) {
+    topic.concat(text + subLen, len - subLen);
+    subscribe(client->id(), topic);
+    return true;
+  }
+  if (len > unsubLen && !strncmp(text, T_unsubscribe_, unsubLen)) {
+    topic.concat(text + unsubLen, len - unsubLen);
+    unsubscribe(client->id(), topic);
+    return true;
+  }
+  return false;
+}
+
+AsyncWebSocketClient* AsyncWebSocketClientHandle::client() const {
+  return _server ? _server->client(_id) : nullptr;
 }
 
 void AsyncWebSocket::close(uint32_t id, uint16_t code, const char* message) {
@@ -823,10 +1261,25 @@ void AsyncWebSocket::cleanupClients(uint16_t maxClients) {
     _clients.front().close();
 
   for (auto iter = std::begin(_clients); iter != std::end(_clients);) {
-    if (iter->shouldBeDeleted())
+    if (iter->shouldBeDeleted()) {
+      {
+#ifdef ESP32
+        std::lock_guard<std::mutex> lock(_lock);
+#endif
+        _clientIndex.erase(iter->id());
+        for (auto topic = _topics.begin(); topic != _topics.end();) {
+          auto& ids = topic->second;
+          ids.erase(std::remove(ids.begin(), ids.end(), iter->id()), ids.end());
+          if (ids.empty())
+            topic = _topics.erase(topic);
+          else
+            topic++;
+        }
+      }
       iter = _clients.erase(iter);
-    else
+    } else {
       iter++;
+    }
   }
 }
 
@@ -940,13 +1393,62 @@ AsyncWebSocket::SendStatus AsyncWebSocket::textAll(AsyncWebSocketMessageBuffer*
 }
 
 AsyncWebSocket::SendStatus AsyncWebSocket::textAll(AsyncWebSocketSharedBuffer buffer) {
+  return _sendAll(buffer, WS_TEXT);
+}
+
+AsyncWebSocket::SendStatus AsyncWebSocket::_sendAll(AsyncWebSocketSharedBuffer buffer, uint8_t opcode, uint32_t key, const std::vector<uint32_t>* ids) {
+  return buffer ? _sendAll(webSocketSharedData(buffer), buffer->size(), opcode, key, ids) : DISCARDED;
+}
+
+AsyncWebSocket::SendStatus AsyncWebSocket::_sendAll(AsyncWebSocketSharedData data, size_t len, uint8_t opcode, uint32_t key, const std::vector<uint32_t>* ids) {
   size_t hit = 0;
   size_t miss = 0;
-  for (auto& c : _clients)
-    if (c.status() == WS_CONNECTED && c.text(buffer))
+  if (!data || !len)
+    return DISCARDED;
+  const AsyncWebSocketFrameHeader header(opcode, len);
+  // the queue budget is taken once for a payload shared by all clients
+  std::shared_ptr<void> reservation = _reserve(len);
+  // compressed once for each window clients negotiated, by index of the window bits from 9
+  bool deflateTried[6] = {};
+  AsyncWebSocketSharedBuffer deflated[6];
+  AsyncWebSocketFrameHeader deflatedHeader[6];
+  std::shared_ptr<void> deflatedReservation[6];
+  auto queue = [&](AsyncWebSocketClient& c) {
+    bool queued = false;
+    if (c.status() == WS_CONNECTED && c._deflateBits) {
+      uint8_t i = c._deflateBits - 9;
+      if (!deflateTried[i]) {
+        deflateTried[i] = true;
+        deflated[i] = webSocketDeflate(data.get(), len, c._deflateBits);
+        if (deflated[i]) {
+          deflatedHeader[i] = AsyncWebSocketFrameHeader(opcode, deflated[i]->size(), true);
+          deflatedReservation[i] = _reserve(deflated[i]->size());
+        }
+      }
+      if (deflated[i])
+        queued = deflatedReservation[i] && c._queueMessage(webSocketSharedData(deflated[i]), deflated[i]->size(), opcode, false, deflatedHeader[i], true, deflatedReservation[i], key);
+      else
+        queued = reservation && c._queueMessage(data, len, opcode, false, header, false, reservation, key);
+    } else if (c.status() == WS_CONNECTED) {
+      queued = reservation && c._queueMessage(data, len, opcode, false, header, false, reservation, key);
+    }
+    if (queued)
       hit++;
     else
       miss++;
+  };
+
+  if (ids) {
+    for (uint32_t id : *ids) {
+      if (AsyncWebSocketClient* c = client(id))
+        queue(*c);
+      else
+        miss++;
+    }
+  } else {
+    for (auto& c : _clients)
+      queue(c);
+  }
   return hit == 0 ? DISCARDED : (miss == 0 ? ENQUEUED : PARTIALLY_ENQUEUED);
 }
 
@@ -1027,14 +1529,79 @@ AsyncWebSocket::SendStatus AsyncWebSocket::binaryAll(AsyncWebSocketMessageBuffer
   return status;
 }
 AsyncWebSocket::SendStatus AsyncWebSocket::binaryAll(AsyncWebSocketSharedBuffer buffer) {
-  size_t hit = 0;
-  size_t miss = 0;
-  for (auto& c : _clients)
-    if (c.status() == WS_CONNECTED && c.binary(buffer))
-      hit++;
-    else
-      miss++;
-  return hit == 0 ? DISCARDED : (miss == 0 ? ENQUEUED : PARTIALLY_ENQUEUED);
+  return _sendAll(buffer, WS_BINARY);
+}
+
+bool AsyncWebSocket::text(uint32_t id, AsyncWebSocketSharedData data, size_t len) {
+  AsyncWebSocketClient* c = client(id);
+  return c && c->text(std::move(data), len);
+}
+bool AsyncWebSocket::binary(uint32_t id, AsyncWebSocketSharedData data, size_t len) {
+  AsyncWebSocketClient* c = client(id);
+  return c && c->binary(std::move(data), len);
+}
+AsyncWebSocket::SendStatus AsyncWebSocket::textAll(AsyncWebSocketSharedData data, size_t len) {
+  return _sendAll(std::move(data), len, WS_TEXT);
+}
+AsyncWebSocket::SendStatus AsyncWebSocket::binaryAll(AsyncWebSocketSharedData data, size_t len) {
+  return _sendAll(std::move(data), len, WS_BINARY);
+}
+
+AsyncWebSocket::SendStatus AsyncWebSocket::textAllLatest(uint32_t key, AsyncWebSocketSharedBuffer buffer) {
+  return _sendAll(buffer, WS_TEXT, key);
+}
+AsyncWebSocket::SendStatus AsyncWebSocket::textAllLatest(uint32_t key, const char* message, size_t len) {
+  return textAllLatest(key, makeSharedBuffer((const uint8_t*)message, len));
+}
+AsyncWebSocket::SendStatus AsyncWebSocket::textAllLatest(uint32_t key, const String& message) {
+  return textAllLatest(key, message.c_str(), message.length());
+}
+AsyncWebSocket::SendStatus AsyncWebSocket::binaryAllLatest(uint32_t key, AsyncWebSocketSharedBuffer buffer) {
+  return _sendAll(buffer, WS_BINARY, key);
+}
+AsyncWebSocket::SendStatus AsyncWebSocket::binaryAllLatest(uint32_t key, const uint8_t* message, size_t len) {
+  return binaryAllLatest(key, makeSharedBuffer(message, len));
+}
+
+bool AsyncWebSocket::post(uint32_t id, AsyncWebSocketSharedBuffer buffer, AwsFrameType type) {
+  return buffer && post(id, webSocketSharedData(buffer), buffer->size(), type);
+}
+bool AsyncWebSocket::post(uint32_t id, AsyncWebSocketSharedData data, size_t len, AwsFrameType type) {
+  return data && len && _post({std::move(data), len, (uint8_t)type, id});
+}
+bool AsyncWebSocket::postAll(AsyncWebSocketSharedBuffer buffer, AwsFrameType type) {
+  return post(0, std::move(buffer), type);
+}
+bool AsyncWebSocket::postAll(AsyncWebSocketSharedData data, size_t len, AwsFrameType type) {
+  return post(0, std::move(data), len, type);
+}
+bool AsyncWebSocket::postAll(const String& message) {
+  return postAll(makeSharedBuffer((const uint8_t*)message.c_str(), message.length()));
+}
+
+bool AsyncWebSocket::_post(posted_t&& posted) {
+  if (_posted.push(std::move(posted)))
+    return true;
+  {
+#ifdef ESP32
+    std::lock_guard<std::mutex> lock(_lock);
+#endif
+    // only acknowledgements and polls of the clients drain the queue, with none connected the caller drops what waits
+    if (std::any_of(_clients.begin(), _clients.end(), [](const AsyncWebSocketClient& c) { return c.status() == WS_CONNECTED; }))
+      return false;
+  }
+  _runPosted();
+  return _posted.push(std::move(posted));
+}
+
+void AsyncWebSocket::_runPosted() {
+  _posted.drain([this](posted_t& p) {
+    if (!p.id) {
+      _sendAll(std::move(p.data), p.len, p.opcode);
+    } else if (AsyncWebSocketClient* c = client(p.id)) {
+      c->_queueData(std::move(p.data), p.len, p.opcode);
+    }
+  });
 }
 
 size_t AsyncWebSocket::printf(uint32_t id, const char* format, ...) {
@@ -1118,6 +1685,12 @@ const char __WS_STR_KEY[] PROGMEM = {"Sec-WebSocket-Key"};
 const char __WS_STR_PROTOCOL[] PROGMEM = {"Sec-WebSocket-Protocol"};
 const char __WS_STR_ACCEPT[] PROGMEM = {"Sec-WebSocket-Accept"};
 const char __WS_STR_UUID[] PROGMEM = {"258EAFA5-E914-47DA-95CA-C5AB0DC85B11"};
+const char __WS_STR_EXTENSIONS[] PROGMEM = {"Sec-WebSocket-Extensions"};
+const char __WS_STR_PERMESSAGE_DEFLATE[] PROGMEM = {"permessage-deflate"};
+const char __WS_STR_SERVER_NO_CONTEXT_TAKEOVER[] PROGMEM = {"server_no_context_takeover"};
+const char __WS_STR_CLIENT_NO_CONTEXT_TAKEOVER[] PROGMEM = {"client_no_context_takeover"};
+const char __WS_STR_SERVER_MAX_WINDOW_BITS[] PROGMEM = {"server_max_window_bits"};
+const char __WS_STR_CLIENT_MAX_WINDOW_BITS[] PROGMEM = {"client_max_window_bits"};
 
 #define WS_STR_UUID_LEN 36
 
@@ -1131,6 +1704,86 @@ const char __WS_STR_UUID[] PROGMEM = {"258EAFA5-E914-47DA-95CA-C5AB0DC85B11"};
 #define WS_STR_ACCEPT     FPSTR(__WS_STR_ACCEPT)
 #define WS_STR_UUID       FPSTR(__WS_STR_UUID)
 
+#define WS_STR_EXTENSIONS                 FPSTR(__WS_STR_EXTENSIONS)
+#define WS_STR_PERMESSAGE_DEFLATE         FPSTR(__WS_STR_PERMESSAGE_DEFLATE)
+#define WS_STR_SERVER_NO_CONTEXT_TAKEOVER FPSTR(__WS_STR_SERVER_NO_CONTEXT_TAKEOVER)
+#define WS_STR_CLIENT_NO_CONTEXT_TAKEOVER FPSTR(__WS_STR_CLIENT_NO_CONTEXT_TAKEOVER)
+#define WS_STR_SERVER_MAX_WINDOW_BITS     FPSTR(__WS_STR_SERVER_MAX_WINDOW_BITS)
+#define WS_STR_CLIENT_MAX_WINDOW_BITS     FPSTR(__WS_STR_CLIENT_MAX_WINDOW_BITS)
+
+/*
+ * Pick the first permessage-deflate offer (RFC 7692 section 7.1) whose parameters can be honoured.
+ * Context takeover is never kept, whatever the offer asks: the response declares no context takeover both ways.
+ * Offers with an unknown, repeated or malformed parameter are declined, as the RFC requires.
+ * Returns the window bits to compress with, at most windowBits, or 0 if no offer is accepted.
+ */
+static uint8_t webSocketNegotiateDeflate(const String& extensions, uint8_t windowBits) {
+  int start = 0;
+  while (start < (int)extensions.length()) {
+    int end = extensions.indexOf(',', start);
+    if (end < 0)
+      end = extensions.length();
+    String offer = extensions.substring(start, end);
+    start = end + 1;
+
+    int sep = offer.indexOf(';');
+    String name = offer.substring(0, sep < 0 ? offer.length() : sep);
+    name.trim();
+    if (!name.equalsIgnoreCase(WS_STR_PERMESSAGE_DEFLATE))
+      continue;
+
+    uint8_t bits = windowBits;
+    bool valid = true;
+    // parameters seen, each one may only appear once
+    uint8_t seen = 0;
+    while (sep >= 0 && valid) {
+      int next = offer.indexOf(';', sep + 1);
+      String param = offer.substring(sep + 1, next < 0 ? offer.length() : next);
+      sep = next;
+
+      int eq = param.indexOf('=');
+      String key = eq < 0 ? param : param.substring(0, eq);
+      String value = eq < 0 ? String() : param.substring(eq + 1);
+      key.trim();
+      value.trim();
+      value.replace("\"", "");
+      long v = value.toInt();
+
+      uint8_t flag = 0;
+      if (key.equalsIgnoreCase(WS_STR_SERVER_NO_CONTEXT_TAKEOVER))
+        flag = 1;
+      else if (key.equalsIgnoreCase(WS_STR_CLIENT_NO_CONTEXT_TAKEOVER))
+        flag = 2;
+      else if (key.equalsIgnoreCase(WS_STR_SERVER_MAX_WINDOW_BITS))
+        flag = 4;
+      else if (key.equalsIgnoreCase(WS_STR_CLIENT_MAX_WINDOW_BITS))
+        flag = 8;
+      if (seen & flag) {
+        valid = false;
+        break;
+      }
+      seen |= flag;
+
+      if (flag == 1 || flag == 2) {
+        valid = eq < 0;
+      } else if (flag == 4) {
+        // windows under 512 bytes are not supported by the encoder
+        valid = v >= 9 && v <= 15;
+        if (valid && v < bits)
+          bits = v;
+      } else if (flag == 8) {
+        // messages received are inflated whole, in any window
+        valid = eq < 0 || (v >= 8 && v <= 15);
+      } else {
+        valid = false;
+      }
+    }
+    if (valid)
+      return bits;
+  }
+  return 0;
+}
+
 bool AsyncWebSocket::canHandle(AsyncWebServerRequest* request) const {
   return _enabled && request->isWebSocketUpgrade() && request->url().equals(_url);
 }
@@ -1154,7 +1807,25 @@ void AsyncWebSocket::handleRequest(AsyncWebServerRequest* request) {
     return;
   }
   const AsyncWebHeader* key = request->getHeader(WS_STR_KEY);
-  AsyncWebServerResponse* response = new AsyncWebSocketResponse(key->value(), this);
+  uint8_t deflateBits = 0;
+  if (_deflateWindowBits && request->hasHeader(WS_STR_EXTENSIONS))
+    deflateBits = webSocketNegotiateDeflate(request->getHeader(WS_STR_EXTENSIONS)->value(), _deflateWindowBits);
+  AsyncWebServerResponse* response = new AsyncWebSocketResponse(key->value(), this, deflateBits);
+  if (deflateBits) {
+    // no context takeover both ways: no compression state is kept between messages
+    String extension;
+    extension.reserve(120);
+    extension.concat(WS_STR_PERMESSAGE_DEFLATE);
+    extension.concat("; ");
+    extension.concat(WS_STR_SERVER_NO_CONTEXT_TAKEOVER);
+    extension.concat("; ");
+    extension.concat(WS_STR_CLIENT_NO_CONTEXT_TAKEOVER);
+    extension.concat("; ");
+    extension.concat(WS_STR_SERVER_MAX_WINDOW_BITS);
+    extension.concat('=');
+    extension.concat(deflateBits);
+    response->addHeader(WS_STR_EXTENSIONS, extension);
+  }
   if (request->hasHeader(WS_STR_PROTOCOL)) {
     const AsyncWebHeader* protocol = request->getHeader(WS_STR_PROTOCOL);
     // ToDo: check protocol
@@ -1188,8 +1859,9 @@ AsyncWebSocketMessageBuffer* AsyncWebSocket::makeBuffer(const uint8_t* data, siz
  * Authentication code from https://github.com/Links2004/arduinoWebSockets/blob/master/src/WebSockets.cpp#L480
  */
 
-AsyncWebSocketResponse::AsyncWebSocketResponse(const String& key, AsyncWebSocket* server) {
+AsyncWebSocketResponse::AsyncWebSocketResponse(const String& key, AsyncWebSocket* server, uint8_t deflateBits) {
   _server = server;
+  _deflateBits = deflateBits;
   _code = 101;
   _sendContentLength = false;
 
@@ -1233,7 +1905,7 @@ size_t AsyncWebSocketResponse::_ack(AsyncWebServerRequest* request, size_t len,
   (void)time;
 
   if (len)
-    _server->_newClient(request);
+    _server->_newClient(request, _deflateBits);
 
   return 0;
 }
@@ -40,9 +40,13 @@
   #endif
 #endif
 
+#include "AsyncMpscQueue.h"
 #include <ESPAsyncWebServer.h>
 
+#include <atomic>
+#include <map>
 #include <memory>
+#include <unordered_map>
 
 #ifdef ESP8266
   #include <Hash.h>
@@ -51,6 +55,53 @@
   #endif
 #endif
 
+// payload bytes queued for a client, and for all the clients of a server together where a broadcast counts once
+#ifndef WS_MAX_QUEUED_BYTES
+  #ifdef ESP8266
+    #define WS_MAX_QUEUED_BYTES (8 * 1024)
+  #else
+    #define WS_MAX_QUEUED_BYTES (32 * 1024)
+  #endif
+#endif
+#ifndef WS_MAX_QUEUED_BYTES_TOTAL
+  #ifdef ESP8266
+    #define WS_MAX_QUEUED_BYTES_TOTAL (16 * 1024)
+  #else
+    #define WS_MAX_QUEUED_BYTES_TOTAL (64 * 1024)
+  #endif
+#endif
+
+// messages posted from other tasks waiting for the network task, a power of two
+#ifndef WS_POST_QUEUE_SIZE
+  #ifdef ESP8266
+    #define WS_POST_QUEUE_SIZE 8
+  #else
+    #define WS_POST_QUEUE_SIZE 16
+  #endif
+#endif
+
+// permessage-deflate: compression window of messages sent (9 to 14), an encoder lives while a message is compressed
+#ifndef WS_DEFLATE_WINDOW_BITS
+  #define WS_DEFLATE_WINDOW_BITS 10
+#endif
+// permessage-deflate: window of messages compressed for a single client, where the encoder is not shared like for broadcasts
+#ifndef WS_DEFLATE_CLIENT_WINDOW_BITS
+  #define WS_DEFLATE_CLIENT_WINDOW_BITS 10
+#endif
+// permessage-deflate: largest compressed message a client may send, once inflated as well,
+// the memory a client may hold to inflate a message
+#ifndef WS_DEFLATE_MAX_MESSAGE_SIZE
+  #ifdef ESP8266
+    #define WS_DEFLATE_MAX_MESSAGE_SIZE 4096
+  #else
+    #define WS_DEFLATE_MAX_MESSAGE_SIZE 16384
+  #endif
+#endif
+// permessage-deflate: shorter messages are sent uncompressed
+#ifndef WS_DEFLATE_MIN_SIZE
+  #define WS_DEFLATE_MIN_SIZE 64
+#endif
+
 #ifndef DEFAULT_MAX_WS_CLIENTS
   #ifdef ESP32
     #define DEFAULT_MAX_WS_CLIENTS 8
@@ -60,6 +111,8 @@
 #endif
 
 using AsyncWebSocketSharedBuffer = std::shared_ptr<std::vector<uint8_t>>;
+// payload bytes that may be owned by the application, its deleter runs once no queued message refers to them
+using AsyncWebSocketSharedData = std::shared_ptr<const uint8_t>;
 
 class AsyncWebSocket;
 class AsyncWebSocketResponse;
@@ -126,27 +179,76 @@ class AsyncWebSocketMessageBuffer {
     size_t length() const { return _buffer->size(); }
 };
 
+// Header of an unmasked message sent as a single frame.
+// Broadcasts encode it once and every client queue keeps a copy, so the frame is written without building a header per client.
+class AsyncWebSocketFrameHeader {
+  public:
+    uint8_t data[4];
+    // 0 when the message is too large to be sent as a single frame
+    uint8_t len{0};
+
+    AsyncWebSocketFrameHeader() {}
+    AsyncWebSocketFrameHeader(uint8_t opcode, size_t payloadLen, bool deflated = false);
+};
+
 class AsyncWebSocketMessage {
   private:
-    AsyncWebSocketSharedBuffer _WSbuffer;
+    AsyncWebSocketSharedData _data;
+    size_t _len{0};
     uint8_t _opcode{WS_TEXT};
     bool _mask{false};
     AwsMessageStatus _status{WS_MSG_ERROR};
     size_t _sent{};
     size_t _ack{};
     size_t _acked{};
+    AsyncWebSocketFrameHeader _header;
+    // payload is permessage-deflate compressed, flagged with RSV1 on the first frame
+    bool _deflated{false};
+    // share of the server queue budget, given back when the last message holding it is gone
+    std::shared_ptr<void> _reservation;
+    // latest value key, 0 for none
+    uint32_t _key{0};
 
   public:
-    AsyncWebSocketMessage(AsyncWebSocketSharedBuffer buffer, uint8_t opcode = WS_TEXT, bool mask = false);
+    AsyncWebSocketMessage(AsyncWebSocketSharedData data, size_t len, uint8_t opcode = WS_TEXT, bool mask = false, const AsyncWebSocketFrameHeader& header = AsyncWebSocketFrameHeader(), bool deflated = false, std::shared_ptr<void> reservation = nullptr, uint32_t key = 0);
 
+    size_t length() const { return _len; }
+    uint32_t key() const { return _key; }
+    bool started() const { return _sent != 0; }
     bool finished() const { return _status != WS_MSG_SENDING; }
     bool betweenFrames() const { return _acked == _ack; }
+    // the whole message is written and waits for its ack
+    bool written() const { return _ack && _sent == _len; }
+    size_t unacked() const { return _ack - _acked; }
+    // bytes of the message written as a single frame with its prebuilt header, 0 if it can not be
+    size_t frameLength() const { return _header.len && !_sent ? _header.len + _len : 0; }
 
     void ack(size_t len, uint32_t time);
+    // adds the whole message as a single frame to the client without sending it
+    bool add(AsyncClient* client);
     size_t send(AsyncClient* client);
 };
 
+// Refers to a client by server and id. Ids are never reused, so a handle kept after the client disconnected
+// resolves to nullptr instead of dangling like a client pointer would.
+class AsyncWebSocketClientHandle {
+  private:
+    AsyncWebSocket* _server{nullptr};
+    uint32_t _id{0};
+
+  public:
+    AsyncWebSocketClientHandle() {}
+    AsyncWebSocketClientHandle(AsyncWebSocket* server, uint32_t id) : _server(server), _id(id) {}
+
+    uint32_t id() const { return _id; }
+    // the connected client, nullptr once it is gone
+    AsyncWebSocketClient* client() const;
+    explicit operator bool() const { return client() != nullptr; }
+};
+
 class AsyncWebSocketClient {
+    friend AsyncWebSocket;
+
   private:
     AsyncClient* _client;
     AsyncWebSocket* _server;
@@ -157,33 +259,54 @@ class AsyncWebSocketClient {
 #endif
     std::deque<AsyncWebSocketControl> _controlQueue;
     std::deque<AsyncWebSocketMessage> _messageQueue;
+    size_t _queuedBytes{0};
+    // when the oldest message not written yet was queued
+    uint32_t _batchTime{0};
     bool closeWhenFull = true;
 
     uint8_t _pstate;
     AwsFrameInfo _pinfo;
+    // frame header received so far, when it is split across segments
+    uint8_t _header[14];
+    uint8_t _headerLen;
+
+    // permessage-deflate window negotiated for messages sent, 0 when not in use
+    uint8_t _deflateBits;
+    // compressed message being received, kept whole until its last frame
+    bool _inflating;
+    bool _inflateDiscard;
+    std::vector<uint8_t> _inflateInput;
 
     uint32_t _lastMessageTime;
     uint32_t _keepAlivePeriod;
 
     bool _queueControl(uint8_t opcode, const uint8_t* data = NULL, size_t len = 0, bool mask = false);
-    bool _queueMessage(AsyncWebSocketSharedBuffer buffer, uint8_t opcode = WS_TEXT, bool mask = false);
+    bool _queueMessage(AsyncWebSocketSharedData data, size_t len, uint8_t opcode = WS_TEXT, bool mask = false, const AsyncWebSocketFrameHeader& header = AsyncWebSocketFrameHeader(), bool deflated = false, std::shared_ptr<void> reservation = nullptr, uint32_t key = 0);
+    bool _queueData(AsyncWebSocketSharedBuffer buffer, uint8_t opcode, uint32_t key = 0);
+    bool _queueData(AsyncWebSocketSharedData data, size_t len, uint8_t opcode, uint32_t key = 0);
     void _runQueue();
+    bool _runBatch();
     void _clearQueue();
+    bool _inflateAppend(const uint8_t* data, size_t len);
+    void _inflateMessage();
 
   public:
     void* _tempObject;
 
-    AsyncWebSocketClient(AsyncWebServerRequest* request, AsyncWebSocket* server);
+    AsyncWebSocketClient(AsyncWebServerRequest* request, AsyncWebSocket* server, uint8_t deflateBits = 0);
     ~AsyncWebSocketClient();
 
     // client id increments for the given server
     uint32_t id() const { return _clientId; }
+    AsyncWebSocketClientHandle handle() { return AsyncWebSocketClientHandle(_server, _clientId); }
     AwsClientStatus status() const { return _status; }
     AsyncClient* client() { return _client; }
     const AsyncClient* client() const { return _client; }
     AsyncWebSocket* server() { return _server; }
     const AsyncWebSocket* server() const { return _server; }
     AwsFrameInfo const& pinfo() const { return _pinfo; }
+    // true if permessage-deflate was negotiated: WS_EVT_DATA then delivers compressed messages inflated and whole
+    bool deflate() const { return _deflateBits != 0; }
 
     //  - If "true" (default), the connection will be closed if the message queue is full.
     // This is the default behavior in yubox-node-org, which is not silently discarding messages but instead closes the connection.
@@ -224,9 +347,11 @@ class AsyncWebSocketClient {
     }
 
     // data packets
-    void message(AsyncWebSocketSharedBuffer buffer, uint8_t opcode = WS_TEXT, bool mask = false) { _queueMessage(buffer, opcode, mask); }
+    void message(AsyncWebSocketSharedBuffer buffer, uint8_t opcode = WS_TEXT, bool mask = false);
     bool queueIsFull() const;
     size_t queueLen() const;
+    // payload bytes of the messages queued
+    size_t queuedBytes() const;
 
     size_t printf(const char* format, ...) __attribute__((format(printf, 2, 3)));
 
@@ -244,6 +369,27 @@ class AsyncWebSocketClient {
     bool binary(const String& message);
     bool binary(AsyncWebSocketMessageBuffer* buffer);
 
+    /**
+     * @brief Send len bytes at data without copying them, e.g. a camera frame:
+     * text(AsyncWebSocketSharedData(fb->buf, [fb](const uint8_t*) { esp_camera_fb_return(fb); }), fb->len)
+     * The bytes must not change until the deleter of data runs, which happens from the network task
+     * once the message is acknowledged or dropped. A message sent compressed only needs them until it is compressed.
+     */
+    bool text(AsyncWebSocketSharedData data, size_t len);
+    bool binary(AsyncWebSocketSharedData data, size_t len);
+
+    // see AsyncWebSocket::subscribe()
+    bool subscribe(const String& topic);
+    bool unsubscribe(const String& topic);
+
+    // Latest value messages: a message sent with a non zero key replaces the queued message with the same key
+    // that has not started to be sent yet, so a slow client only gets the newest value of each key.
+    bool textLatest(uint32_t key, AsyncWebSocketSharedBuffer buffer);
+    bool textLatest(uint32_t key, const char* message, size_t len);
+    bool textLatest(uint32_t key, const String& message);
+    bool binaryLatest(uint32_t key, AsyncWebSocketSharedBuffer buffer);
+    bool binaryLatest(uint32_t key, const uint8_t* message, size_t len);
+
     bool canSend() const;
 
     // system callbacks (do not call)
@@ -268,11 +414,31 @@ using AwsEventHandler = std::function<void(AsyncWebSocket* server, AsyncWebSocke
 class AsyncWebSocket : public AsyncWebHandler {
   private:
     String _url;
+    // declared before the clients, whose queued messages give their bytes back when destroyed
+    std::atomic<size_t> _queuedBytes{0};
+    size_t _maxQueuedBytes{WS_MAX_QUEUED_BYTES};
+    size_t _maxQueuedBytesTotal{WS_MAX_QUEUED_BYTES_TOTAL};
+    size_t _batchSize{0};
+    uint32_t _batchDelay{0};
     std::list<AsyncWebSocketClient> _clients;
+    // clients by id, for constant time lookups
+    std::unordered_map<uint32_t, AsyncWebSocketClient*> _clientIndex;
+    // subscribed client ids by topic
+    std::map<String, std::vector<uint32_t>> _topics;
+    bool _topicCommands{false};
     uint32_t _cNextId;
     AwsEventHandler _eventHandler{nullptr};
     AwsHandshakeHandler _handshakeHandler;
     bool _enabled;
+    uint8_t _deflateWindowBits{0};
+    size_t _deflateMaxMessageSize{WS_DEFLATE_MAX_MESSAGE_SIZE};
+    struct posted_t {
+        AsyncWebSocketSharedData data;
+        size_t len;
+        uint8_t opcode;
+        uint32_t id; // 0 for all the clients
+    };
+    AsyncMpscQueue<posted_t, WS_POST_QUEUE_SIZE> _posted;
 #ifdef ESP32
     mutable std::mutex _lock;
 #endif
@@ -284,18 +450,71 @@ class AsyncWebSocket : public AsyncWebHandler {
       PARTIALLY_ENQUEUED = 2,
     } SendStatus;
 
+  private:
+    SendStatus _sendAll(AsyncWebSocketSharedBuffer buffer, uint8_t opcode, uint32_t key = 0, const std::vector<uint32_t>* ids = nullptr);
+    SendStatus _sendAll(AsyncWebSocketSharedData data, size_t len, uint8_t opcode, uint32_t key = 0, const std::vector<uint32_t>* ids = nullptr);
+    bool _handleTopicCommand(AsyncWebSocketClient* client, const AwsFrameInfo* info, const uint8_t* data, size_t len);
+    bool _post(posted_t&& posted);
+
+  public:
     explicit AsyncWebSocket(const char* url) : _url(url), _cNextId(1), _enabled(true) {}
     AsyncWebSocket(const String& url) : _url(url), _cNextId(1), _enabled(true) {}
     ~AsyncWebSocket() {};
     const char* url() const { return _url.c_str(); }
     void enable(bool e) { _enabled = e; }
     bool enabled() const { return _enabled; }
+    /**
+     * @brief Accept the permessage-deflate extension (RFC 7692) offered by clients
+     * Context takeover is never used: the server answers with server_no_context_takeover and client_no_context_takeover
+     * whatever the offer, so a client holds no compression state between messages
+     * and a broadcast is compressed once for all the clients that negotiated the same window.
+     * Messages sent to a single client are compressed with at most WS_DEFLATE_CLIENT_WINDOW_BITS.
+     *
+     * @param windowBits window used to compress messages sent (9 to 14), lowered to what a client asks for
+     * @param maxMessageSize largest compressed message accepted from a client, once inflated as well: larger ones close the connection with 1009.
+     * Unlike uncompressed messages, which are passed to the handler frame by frame, a compressed message is kept whole
+     * and inflated at once, so this bounds the memory a client uses for it (up to twice this size while inflating).
+     */
+    void enableDeflate(uint8_t windowBits = WS_DEFLATE_WINDOW_BITS, size_t maxMessageSize = WS_DEFLATE_MAX_MESSAGE_SIZE);
+    void disableDeflate() { _deflateWindowBits = 0; }
+    size_t deflateMaxMessageSize() const { return _deflateMaxMessageSize; }
+
+    /**
+     * @brief Limit the payload bytes queued for each client and for all clients together
+     * A message that does not fit a client queue is handled as set by setCloseClientOnQueueFull(),
+     * one that does not fit the total is discarded. A client with an empty queue always accepts one message.
+     */
+    void setMaxQueuedBytes(size_t perClient, size_t total = WS_MAX_QUEUED_BYTES_TOTAL) {
+      _maxQueuedBytes = perClient;
+      _maxQueuedBytesTotal = total;
+    }
+    size_t maxQueuedBytes() const { return _maxQueuedBytes; }
+    // payload bytes queued for all clients, a broadcast counted once
+    size_t queuedBytes() const { return _queuedBytes; }
+
+    /**
+     * @brief Write queued messages that fit as whole frames together with a single send(), off by default
+     * A connection with nothing in flight writes right away. While data is in flight, messages queued meanwhile
+     * wait for its acknowledgement to be written together, or are written after it without waiting for it
+     * once maxDelay ms have passed or maxBytes are queued.
+     *
+     * @param maxBytes largest batch written at once, 0 to write one message at a time
+     * @param maxDelay longest wait for the acknowledgement, checked when a message is queued, 0 always waits for it
+     */
+    void setBatching(size_t maxBytes, uint32_t maxDelay = 0) {
+      _batchSize = maxBytes;
+      _batchDelay = maxDelay;
+    }
+    size_t batchSize() const { return _batchSize; }
+    uint32_t batchDelay() const { return _batchDelay; }
+
     bool availableForWriteAll();
     bool availableForWrite(uint32_t id);
 
     size_t count() const;
     AsyncWebSocketClient* client(uint32_t id);
     bool hasClient(uint32_t id) { return client(id) != nullptr; }
+    AsyncWebSocketClientHandle handle(uint32_t id) { return AsyncWebSocketClientHandle(this, id); }
 
     void close(uint32_t id, uint16_t code = 0, const char* message = NULL);
     void closeAll(uint16_t code = 0, const char* message = NULL);
@@ -332,6 +551,56 @@ class AsyncWebSocket : public AsyncWebHandler {
     SendStatus binaryAll(AsyncWebSocketMessageBuffer* buffer);
     SendStatus binaryAll(AsyncWebSocketSharedBuffer buffer);
 
+    // zero copy sends, see AsyncWebSocketClient::text(AsyncWebSocketSharedData, size_t): the deleter runs once all clients are done with the bytes
+    bool text(uint32_t id, AsyncWebSocketSharedData data, size_t len);
+    bool binary(uint32_t id, AsyncWebSocketSharedData data, size_t len);
+    SendStatus textAll(AsyncWebSocketSharedData data, size_t len);
+    SendStatus binaryAll(AsyncWebSocketSharedData data, size_t len);
+
+    // latest value broadcasts, see AsyncWebSocketClient::textLatest()
+    SendStatus textAllLatest(uint32_t key, AsyncWebSocketSharedBuffer buffer);
+    SendStatus textAllLatest(uint32_t key, const char* message, size_t len);
+    SendStatus textAllLatest(uint32_t key, const String& message);
+    SendStatus binaryAllLatest(uint32_t key, AsyncWebSocketSharedBuffer buffer);
+    SendStatus binaryAllLatest(uint32_t key, const uint8_t* message, size_t len);
+
+    /**
+     * @brief Subscribe a client to a topic, its subscriptions are dropped when it is removed
+     * @return false if the client does not exist
+     */
+    bool subscribe(uint32_t id, const String& topic);
+    bool unsubscribe(uint32_t id, const String& topic);
+    size_t subscribers(const String& topic) const;
+    /**
+     * @brief Send a message to the clients subscribed to a topic
+     * The buffer is shared by all of them and compressed once per negotiated window, like textAll().
+     */
+    SendStatus publish(const String& topic, AsyncWebSocketSharedBuffer buffer, AwsFrameType type = WS_TEXT);
+    SendStatus publish(const String& topic, const uint8_t* message, size_t len, AwsFrameType type = WS_TEXT);
+    SendStatus publish(const String& topic, const String& message);
+    /**
+     * @brief Let clients manage their own subscriptions with "subscribe:<topic>" and "unsubscribe:<topic>" text messages,
+     * which are then consumed by the server and not passed to the event handler. Off by default.
+     */
+    void setTopicCommands(bool enable) { _topicCommands = enable; }
+
+    /**
+     * @brief Hand a message over to the network task, from any task and without taking a lock
+     * It is queued for the clients like with text() or textAll() by the next acknowledgement or poll of any client,
+     * or when a client connects, so its latency is bounded by the poll interval of the TCP stack (500 ms).
+     * A message still waiting when a client connects goes to the clients connected before, with none it is dropped.
+     * Without any client nothing drains the queue: once WS_POST_QUEUE_SIZE messages are waiting, the next post()
+     * drops them to queue its own message.
+     * The buffer is only referenced: building it is the only allocation, none with AsyncWebSocketSharedData.
+     *
+     * @return false if WS_POST_QUEUE_SIZE messages are already waiting for the connected clients
+     */
+    bool post(uint32_t id, AsyncWebSocketSharedBuffer buffer, AwsFrameType type = WS_TEXT);
+    bool post(uint32_t id, AsyncWebSocketSharedData data, size_t len, AwsFrameType type = WS_TEXT);
+    bool postAll(AsyncWebSocketSharedBuffer buffer, AwsFrameType type = WS_TEXT);
+    bool postAll(AsyncWebSocketSharedData data, size_t len, AwsFrameType type = WS_TEXT);
+    bool postAll(const String& message);
+
     size_t printf(uint32_t id, const char* format, ...) __attribute__((format(printf, 3, 4)));
     size_t printfAll(const char* format, ...) __attribute__((format(printf, 2, 3)));
 
@@ -349,7 +618,11 @@ class AsyncWebSocket : public AsyncWebHandler {
 
     // system callbacks (do not call)
     uint32_t _getNextId() { return _cNextId++; }
-    AsyncWebSocketClient* _newClient(AsyncWebServerRequest* request);
+    AsyncWebSocketClient* _newClient(AsyncWebServerRequest* request, uint8_t deflateBits = 0);
+    // takes len bytes of the total queue budget, nullptr if they do not fit
+    std::shared_ptr<void> _reserve(size_t len);
+    // queues the posted messages, on the network task, or drops them from post() when no client is connected
+    void _runPosted();
     void _handleEvent(AsyncWebSocketClient* client, AwsEventType type, void* arg, uint8_t* data, size_t len);
     bool canHandle(AsyncWebServerRequest* request) const override final;
     void handleRequest(AsyncWebServerRequest* request) override final;
@@ -366,9 +639,10 @@ class AsyncWebSocketResponse : public AsyncWebServerResponse {
   private:
     String _content;
     AsyncWebSocket* _server;
+    uint8_t _deflateBits;
 
   public:
-    AsyncWebSocketResponse(const String& key, AsyncWebSocket* server);
+    AsyncWebSocketResponse(const String& key, AsyncWebSocket* server, uint8_t deflateBits = 0);
     void _respond(AsyncWebServerRequest* request);
     size_t _ack(AsyncWebServerRequest* request, size_t len, uint32_t time);
     bool _sourceValid() const { return true; }
@@ -0,0 +1,48 @@
+#ifndef ASYNCWEBSOCKETMASK_H_
+#define ASYNCWEBSOCKETMASK_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * XOR len bytes of src with the 4 byte websocket mask into dst (which may be src).
+ * offset is the payload index of src[0], so that the mask is applied where the previous call stopped.
+ * Bytes are processed a machine word at a time once dst is word aligned, with a mask rotated for that offset.
+ */
+inline void webSocketMask(uint8_t* dst, const uint8_t* src, size_t len, const uint8_t* mask, size_t offset) {
+  typedef uintptr_t word_t;
+  size_t i = 0;
+  while (i < len && ((uintptr_t)(dst + i) & (sizeof(word_t) - 1))) {
+    dst[i] = src[i] ^ mask[(offset + i) & 3];
+    i++;
+  }
+
+  if (len - i >= sizeof(word_t)) {
+    uint8_t rotated[sizeof(word_t)];
+    for (size_t k = 0; k < sizeof(word_t); k++)
+      rotated[k] = mask[(offset + i + k) & 3];
+    word_t m;
+    memcpy(&m, rotated, sizeof(word_t));
+
+    word_t w;
+    if (!((uintptr_t)(src + i) & (sizeof(word_t) - 1))) {
+      for (; len - i >= sizeof(word_t); i += sizeof(word_t)) {
+        memcpy(&w, __builtin_assume_aligned(src + i, sizeof(word_t)), sizeof(word_t));
+        w ^= m;
+        memcpy(__builtin_assume_aligned(dst + i, sizeof(word_t)), &w, sizeof(word_t));
+      }
+    } else {
+      for (; len - i >= sizeof(word_t); i += sizeof(word_t)) {
+        memcpy(&w, src + i, sizeof(word_t));
+        w ^= m;
+        memcpy(__builtin_assume_aligned(dst + i, sizeof(word_t)), &w, sizeof(word_t));
+      }
+    }
+  }
+
+  for (; i < len; i++)
+    dst[i] = src[i] ^ mask[(offset + i) & 3];
+}
+
+#endif /* ASYNCWEBSOCKETMASK_H_ */
@@ -31,6 +31,10 @@
 #include <unordered_map>
 #include <vector>
 
+#ifdef ESP32
+  #include <mutex>
+#endif
+
 #ifdef ESP32
   #include <AsyncTCP.h>
   #include <WiFi.h>
@@ -46,6 +50,7 @@
   #error Platform not supported
 #endif
 
+#include "AsyncGzip.h"
 #include "literals.h"
 
 #define ASYNCWEBSERVER_VERSION          "3.6.0"
@@ -70,6 +75,7 @@ class AsyncWebHandler;
 class AsyncStaticWebHandler;
 class AsyncCallbackWebHandler;
 class AsyncResponseStream;
+class AsyncChunkedResponseStream;
 class AsyncMiddlewareChain;
 
 #if defined(TARGET_RP2040)
@@ -105,6 +111,19 @@ namespace fs {
 // if this value is returned when asked for data, packet will not be sent and you will be asked for data again
 #define RESPONSE_TRY_AGAIN          0xFFFFFFFF
 #define RESPONSE_STREAM_BUFFER_SIZE 1460
+// chunks of RESPONSE_STREAM_BUFFER_SIZE a streaming response may hold before writes are refused
+#ifndef RESPONSE_STREAM_MAX_CHUNKS
+  #define RESPONSE_STREAM_MAX_CHUNKS 4
+#endif
+
+// number of send buffers in the shared pool, 0 keeps allocating send buffers on demand
+#ifndef ASYNC_SEND_BUFFER_COUNT
+  #define ASYNC_SEND_BUFFER_COUNT 0
+#endif
+// size of each send buffer in the shared pool
+#ifndef ASYNC_SEND_BUFFER_SIZE
+  #define ASYNC_SEND_BUFFER_SIZE (RESPONSE_STREAM_BUFFER_SIZE * 2)
+#endif
 
 typedef uint8_t WebRequestMethodComposite;
 typedef std::function<void(void)> ArDisconnectHandler;
@@ -175,6 +194,7 @@ typedef enum {
 
 typedef std::function<size_t(uint8_t*, size_t, size_t)> AwsResponseFiller;
 typedef std::function<String(const String&)> AwsTemplateProcessor;
+typedef std::function<void(AsyncChunkedResponseStream* stream)> AwsStreamWritableHandler;
 
 class AsyncWebServerRequest {
     using File = fs::File;
@@ -380,6 +400,13 @@ class AsyncWebServerRequest {
 
     AsyncResponseStream* beginResponseStream(const char* contentType, size_t bufferSize = RESPONSE_STREAM_BUFFER_SIZE);
     AsyncResponseStream* beginResponseStream(const String& contentType, size_t bufferSize = RESPONSE_STREAM_BUFFER_SIZE) { return beginResponseStream(contentType.c_str(), bufferSize); }
+    /**
+     * @brief Create a response that is sent while it is being written
+     * Written bytes are queued in at most maxChunks chunks of chunkSize bytes and sent as soon as the response is handed to send().
+     * Call end() on the returned stream once everything has been written.
+     */
+    AsyncChunkedResponseStream* beginChunkedResponseStream(const char* contentType, size_t chunkSize = RESPONSE_STREAM_BUFFER_SIZE, size_t maxChunks = RESPONSE_STREAM_MAX_CHUNKS);
+    AsyncChunkedResponseStream* beginChunkedResponseStream(const String& contentType, size_t chunkSize = RESPONSE_STREAM_BUFFER_SIZE, size_t maxChunks = RESPONSE_STREAM_MAX_CHUNKS) { return beginChunkedResponseStream(contentType.c_str(), chunkSize, maxChunks); }
 
 #ifndef ESP8266
     [[deprecated("Replaced by beginResponse(int code, const String& contentType, const uint8_t* content, size_t len, AwsTemplateProcessor callback = nullptr)")]]
@@ -689,6 +716,28 @@ class AsyncRateLimitMiddleware : public AsyncMiddleware {
     std::list<uint32_t> _requestTimes;
 };
 
+// Compression Middleware: gzip the generated responses on the fly when the client accepts it,
+// files served as is and responses with a Content-Encoding are left untouched
+class AsyncCompressionMiddleware : public AsyncMiddleware {
+  public:
+    void setLevel(uint8_t level) { _level = level; }
+    void setWindowBits(uint8_t windowBits) { _windowBits = windowBits; }
+    // memory all compressed responses may use at the same time, further responses are sent uncompressed
+    void setMaxMemory(size_t maxMemory) { _maxMemory = maxMemory; }
+
+    // returns false for content types that are already compressed (images, audio, video, archives, fonts...)
+    static bool isCompressible(const String& contentType);
+    // returns true if an Accept-Encoding header value lists gzip with a non-zero quality
+    static bool acceptsGzip(const String& acceptEncoding);
+
+    void run(AsyncWebServerRequest* request, ArMiddlewareNext next);
+
+  private:
+    uint8_t _level = ASYNC_GZIP_LEVEL;
+    uint8_t _windowBits = ASYNC_GZIP_WINDOW_BITS;
+    size_t _maxMemory = ASYNC_GZIP_MAX_MEMORY;
+};
+
 /*
  * REWRITE :: One instance can be handle any Request (done by the Server)
  * */
@@ -781,6 +830,7 @@ class AsyncWebServerResponse {
     void setContentLength(size_t len);
     void setContentType(const String& type) { setContentType(type.c_str()); }
     void setContentType(const char* type);
+    const String& contentType() const { return _contentType; }
     bool addHeader(const char* name, const char* value, bool replaceExisting = true);
     bool addHeader(const String& name, const String& value, bool replaceExisting = true) { return addHeader(name.c_str(), value.c_str(), replaceExisting); }
     bool addHeader(const char* name, long value, bool replaceExisting = true) { return addHeader(name, String(value), replaceExisting); }
@@ -789,6 +839,17 @@ class AsyncWebServerResponse {
     const AsyncWebHeader* getHeader(const char* name) const;
     const std::list<AsyncWebHeader>& getHeaders() const { return _headers; }
 
+    /**
+     * @brief gzip the content on the fly, the response switches to chunked transfer encoding
+     * @note must be called before the response is sent, the client has to accept the gzip encoding
+     *
+     * @param level compression level, from 1 (fastest) to 9 (smallest output)
+     * @param windowBits size of the compression window as a power of two (9 to 14), see AsyncGzipEncoder::memoryUsage()
+     * @param maxMemory memory all encoders may use together, the content is sent uncompressed beyond it
+     * @return true if the content will be compressed
+     */
+    virtual bool compress(__unused uint8_t level = ASYNC_GZIP_LEVEL, __unused uint8_t windowBits = ASYNC_GZIP_WINDOW_BITS, __unused size_t maxMemory = ASYNC_GZIP_MAX_MEMORY) { return false; }
+
 #ifndef ESP8266
     [[deprecated("Use instead: _assembleHead(String& buffer, uint8_t version)")]]
 #endif
@@ -803,6 +864,8 @@ class AsyncWebServerResponse {
     virtual bool _finished() const;
     virtual bool _failed() const;
     virtual bool _sourceValid() const;
+    // content served as is from storage, which is better compressed ahead of time than on each request
+    virtual bool _staticContent() const { return false; }
     virtual void _respond(AsyncWebServerRequest* request);
     virtual size_t _ack(AsyncWebServerRequest* request, size_t len, uint32_t time);
 };
@@ -919,6 +982,70 @@ class DefaultHeaders {
     }
 };
 
+/**
+ * @brief Fixed set of scratch buffers that responses and masked websocket frames are built in before being written
+ * A buffer is only borrowed for a single write and returned right after: the TCP stack copies the data,
+ * so the pool saves a malloc and free on every ack, it does not bound the memory of the data in flight,
+ * which is held by the TCP stack up to its send buffer for each connection. SSE clients write their queued
+ * messages directly and do not use it.
+ * As writes happen one at a time on the network task, a few buffers are enough; when every buffer is borrowed
+ * (writes from other tasks), a sender backs off to its next ack or poll, up to the TCP poll interval (500 ms).
+ * Until begin() is called with a non-zero count, buffers are allocated on demand.
+ */
+class AsyncSendBufferPool {
+    uint8_t* _pool{nullptr};
+    size_t _count{0};
+    size_t _size{0};
+    std::vector<uint8_t*> _free;
+#ifdef ESP32
+    mutable std::mutex _lock;
+#endif
+
+  public:
+    AsyncSendBufferPool();
+    ~AsyncSendBufferPool() { end(); }
+
+    AsyncSendBufferPool(AsyncSendBufferPool const&) = delete;
+    AsyncSendBufferPool& operator=(AsyncSendBufferPool const&) = delete;
+
+    /**
+     * @brief allocate the pool
+     *
+     * @param count number of buffers, 0 disables the pool
+     * @param size size of each buffer
+     * @return false if the memory could not be allocated or buffers of the current pool are still borrowed
+     */
+    bool begin(size_t count, size_t size);
+
+    /**
+     * @brief release the pool memory, going back to allocating on demand
+     * fails if buffers are still borrowed
+     */
+    bool end();
+
+    /**
+     * @brief borrow a buffer
+     *
+     * @param len requested length, reduced to the buffer size if it is larger
+     * @return uint8_t* buffer or nullptr if the pool is exhausted
+     */
+    uint8_t* acquire(size_t& len);
+
+    /**
+     * @brief give back a buffer obtained from acquire()
+     */
+    void release(uint8_t* buf);
+
+    bool enabled() const { return _pool != nullptr; }
+    size_t bufferSize() const { return _size; }
+    size_t available() const;
+
+    static AsyncSendBufferPool& Instance() {
+      static AsyncSendBufferPool instance;
+      return instance;
+    }
+};
+
 #include "AsyncEventSource.h"
 #include "AsyncWebSocket.h"
 #include "WebHandlerImpl.h"
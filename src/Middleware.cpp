@@ -254,3 +254,70 @@ void AsyncRateLimitMiddleware::run(AsyncWebServerRequest* request, ArMiddlewareN
     request->send(response);
   }
 }
+
+bool AsyncCompressionMiddleware::isCompressible(const String& contentType) {
+  if (contentType.startsWith(asyncsrv::T_image_))
+    return contentType.startsWith(asyncsrv::T_image_svg_xml) || contentType.startsWith(asyncsrv::T_image_x_icon);
+  return !contentType.startsWith(asyncsrv::T_audio_) &&
+         !contentType.startsWith(asyncsrv::T_video_) &&
+         !contentType.startsWith(asyncsrv::T_application_gzip) &&
+         !contentType.startsWith(asyncsrv::T_application_x_gzip) &&
+         !contentType.startsWith(asyncsrv::T_application_zip) &&
+         !contentType.startsWith(asyncsrv::T_application_pdf) &&
+         !contentType.startsWith(asyncsrv::T_application_octet_stream) &&
+         !contentType.startsWith(asyncsrv::T_font_woff) && // woff and woff2
+         !contentType.startsWith(asyncsrv::T_text_event_stream);
+}
+
+bool AsyncCompressionMiddleware::acceptsGzip(const String& acceptEncoding) {
+  int start = 0;
+  while (start < (int)acceptEncoding.length()) {
+    int end = acceptEncoding.indexOf(',', start);
+    if (end < 0)
+      end = acceptEncoding.length();
+    String coding = acceptEncoding.substring(start, end);
+    start = end + 1;
+    String params;
+    int semicolon = coding.indexOf(';');
+    if (semicolon >= 0) {
+      params = coding.substring(semicolon + 1);
+      coding = coding.substring(0, semicolon);
+    }
+    coding.trim();
+    if (!coding.equalsIgnoreCase(asyncsrv::T_gzip))
+      continue;
+    // q=0 refuses the coding, q=0.000 as well
+    params.trim();
+    params.toLowerCase();
+    if (!params.startsWith(asyncsrv::T_q_))
+      return true;
+    for (size_t i = strlen(asyncsrv::T_q_); i < params.length(); i++) {
+      if (params[i] >= '1' && params[i] <= '9')
+        return true;
+      if (params[i] != '0' && params[i] != '.')
+        break;
+    }
+    return false;
+  }
+  return false;
+}
+
+void AsyncCompressionMiddleware::run(AsyncWebServerRequest* request, ArMiddlewareNext next) {
+  next();
+
+  AsyncWebServerResponse* response = request->getResponse();
+  if (!response || request->method() == HTTP_HEAD)
+    return;
+  // no body to compress
+  if (response->code() < 200 || response->code() == 204 || response->code() == 304)
+    return;
+  const AsyncWebHeader* acceptEncoding = request->getHeader(asyncsrv::T_Accept_Encoding);
+  if (!acceptEncoding || !acceptsGzip(acceptEncoding->value()))
+    return;
+  if (response->getHeader(asyncsrv::T_Content_Encoding) || response->_staticContent())
+    return;
+  if (!isCompressible(response->contentType()))
+    return;
+  // the memory budget is taken by the encoder itself, the response is sent uncompressed when it is spent
+  response->compress(_level, _windowBits, _maxMemory);
+}
@@ -48,6 +48,8 @@ class AsyncStaticWebHandler : public AsyncWebHandler {
     AwsTemplateProcessor _callback;
     bool _isDir;
     bool _tryGzipFirst = true;
+    bool _compileTemplate = false;
+    size_t _readAhead = 0;
 
   public:
     AsyncStaticWebHandler(const char* uri, FS& fs, const char* path, const char* cache_control);
@@ -71,6 +73,24 @@ class AsyncStaticWebHandler : public AsyncWebHandler {
     AsyncStaticWebHandler& setLastModified();
 
     AsyncStaticWebHandler& setTemplateProcessor(AwsTemplateProcessor newCallback);
+
+    /**
+     * @brief Parse template files once and keep them compiled in AsyncTemplateCache (keyed by path and last write time)
+     * instead of scanning the whole file for placeholders on each request.
+     * @note requires a file system reporting the file last write time
+     *
+     * @param value
+     * @return AsyncStaticWebHandler&
+     */
+    AsyncStaticWebHandler& setCompileTemplate(bool value);
+
+    /**
+     * @brief Read files ahead while the previously sent data is in flight (see AsyncFileResponse::setReadAhead)
+     *
+     * @param size read-ahead buffer size per response, 0 to disable (default)
+     * @return AsyncStaticWebHandler&
+     */
+    AsyncStaticWebHandler& setReadAhead(size_t size);
 };
 
 class AsyncCallbackWebHandler : public AsyncWebHandler {
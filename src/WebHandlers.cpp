@@ -239,7 +239,12 @@ void AsyncStaticWebHandler::handleRequest(AsyncWebServerRequest* request) {
       request->_tempFile.close();
       response = new AsyncBasicResponse(304); // Not modified
     } else {
-      response = new AsyncFileResponse(request->_tempFile, filename, emptyString, false, _callback);
+      AsyncFileResponse* fileResponse = new AsyncFileResponse(request->_tempFile, filename, emptyString, false, _callback);
+      if (_compileTemplate)
+        fileResponse->compileTemplate();
+      if (_readAhead)
+        fileResponse->setReadAhead(_readAhead);
+      response = fileResponse;
     }
 
     response->addHeader(T_ETag, etag.c_str());
@@ -258,6 +263,16 @@ AsyncStaticWebHandler& AsyncStaticWebHandler::setTemplateProcessor(AwsTemplatePr
   return *this;
 }
 
+AsyncStaticWebHandler& AsyncStaticWebHandler::setCompileTemplate(bool value) {
+  _compileTemplate = value;
+  return *this;
+}
+
+AsyncStaticWebHandler& AsyncStaticWebHandler::setReadAhead(size_t size) {
+  _readAhead = size;
+  return *this;
+}
+
 void AsyncCallbackWebHandler::setUri(const String& uri) {
   _uri = uri;
   _isRegex = uri.startsWith("^") && uri.endsWith("$");
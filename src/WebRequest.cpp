@@ -786,6 +786,10 @@ AsyncResponseStream* AsyncWebServerRequest::beginResponseStream(const char* cont
   return new AsyncResponseStream(contentType, bufferSize);
 }
 
+AsyncChunkedResponseStream* AsyncWebServerRequest::beginChunkedResponseStream(const char* contentType, size_t chunkSize, size_t maxChunks) {
+  return new AsyncChunkedResponseStream(contentType, chunkSize, maxChunks, _version != 0);
+}
+
 AsyncWebServerResponse* AsyncWebServerRequest::beginResponse_P(int code, const String& contentType, PGM_P content, AwsTemplateProcessor callback) {
   return new AsyncProgmemResponse(code, contentType, (const uint8_t*)content, strlen_P(content), callback);
 }
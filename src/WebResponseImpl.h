@@ -28,8 +28,13 @@
 #endif
 #include "literals.h"
 #include <StreamString.h>
+#include <deque>
+#include <list>
 #include <memory>
 #include <vector>
+#ifdef ESP32
+  #include <mutex>
+#endif
 
 // It is possible to restore these defines, but one can use _min and _max instead. Or std::min, std::max.
 
@@ -45,6 +50,91 @@ class AsyncBasicResponse : public AsyncWebServerResponse {
     bool _sourceValid() const override final { return true; }
 };
 
+#ifndef TEMPLATE_PLACEHOLDER
+  #define TEMPLATE_PLACEHOLDER '%'
+#endif
+
+#define TEMPLATE_PARAM_NAME_LENGTH 32
+
+// max number of compiled templates kept in AsyncTemplateCache
+#ifndef TEMPLATE_CACHE_SIZE
+  #define TEMPLATE_CACHE_SIZE 4
+#endif
+
+/**
+ * @brief Template file parsed once into literal spans and placeholder references
+ * literal spans are offsets into the template file, so a response only has to stream them and call the processor for placeholders
+ *
+ */
+class AsyncCompiledTemplate {
+  public:
+    struct Segment {
+        size_t offset; // offset of the literal span in the template file
+        size_t length; // length of the literal span, 0 for a placeholder
+        int param;     // index in names() for a placeholder, -1 for a literal span
+    };
+
+    /**
+     * @brief parse template file content
+     * @note file position is left undefined
+     *
+     * @param file
+     * @return std::shared_ptr<AsyncCompiledTemplate> nullptr if out of memory
+     */
+    static std::shared_ptr<AsyncCompiledTemplate> compile(fs::File& file);
+
+    const std::vector<Segment>& segments() const { return _segments; }
+    const std::vector<String>& names() const { return _names; }
+
+  private:
+    std::vector<Segment> _segments;
+    std::vector<String> _names;
+
+    void _addLiteral(size_t offset, size_t length);
+    void _addParam(const char* name, size_t length);
+};
+
+/**
+ * @brief Cache of compiled templates keyed by file path, last write time and size
+ *
+ */
+class AsyncTemplateCache {
+  private:
+    struct Entry {
+        String path;
+        time_t lastWrite;
+        size_t size;
+        std::shared_ptr<const AsyncCompiledTemplate> tpl;
+    };
+    std::list<Entry> _entries;
+#ifdef ESP32
+    std::mutex _lock;
+#endif
+
+  public:
+    AsyncTemplateCache() = default;
+    AsyncTemplateCache(AsyncTemplateCache const&) = delete;
+    AsyncTemplateCache& operator=(AsyncTemplateCache const&) = delete;
+
+    /**
+     * @brief get the compiled template for a file, compiling it if missing or outdated
+     * @note file must report its last write time, otherwise nothing is cached
+     *
+     * @param file opened template file
+     * @param path key to store the template with
+     * @return std::shared_ptr<const AsyncCompiledTemplate> nullptr if the file can't be cached
+     */
+    std::shared_ptr<const AsyncCompiledTemplate> get(fs::File& file, const String& path);
+
+    // drop all compiled templates
+    void clear();
+
+    static AsyncTemplateCache& Instance() {
+      static AsyncTemplateCache instance;
+      return instance;
+    }
+};
+
 class AsyncAbstractResponse : public AsyncWebServerResponse {
   private:
     // amount of responce data in-flight, i.e. sent, but not acked yet
@@ -52,31 +142,55 @@ class AsyncAbstractResponse : public AsyncWebServerResponse {
     // in-flight queue credits
     size_t _in_flight_credit{2};
     String _head;
-    // Data is inserted into cache at begin().
-    // This is inefficient with vector, but if we use some other container,
-    // we won't be able to access it as contiguous array of bytes when reading from it,
-    // so by gaining performance in one place, we'll lose it in another.
-    std::vector<uint8_t> _cache;
-    size_t _readDataFromCacheOrContent(uint8_t* data, const size_t len);
+    // placeholder value being written, it may span several buffers
+    String _tplValue;
+    size_t _tplValuePos{0};
+    // source data read past a placeholder start, it is processed before reading from the source again.
+    // It never holds more than one buffer plus a placeholder, and is allocated only once.
+    uint8_t* _tplLookahead{nullptr};
+    size_t _tplLookaheadSize{0};
+    size_t _tplLookaheadPos{0};
+    size_t _tplLookaheadLen{0};
+    bool _tplSourceEnd{false};
+    // position in the compiled template
+    size_t _tplSegment{0};
+    size_t _tplSegmentPos{0};
+    size_t _writeTemplateValue(uint8_t* data, size_t len);
+    size_t _readTemplateSource(uint8_t* data, size_t len);
+    bool _pushBackTemplateSource(const uint8_t* data, size_t len);
+    size_t _readTemplateLookahead(size_t len);
     size_t _fillBufferAndProcessTemplates(uint8_t* buf, size_t maxLen);
+    size_t _fillBufferFromCompiledTemplate(uint8_t* buf, size_t maxLen);
+    // on the fly gzip encoding of the (template processed) content
+    AsyncGzipEncoder* _gzip{nullptr};
+    bool _gzipSourceBounded{false};
+    size_t _gzipSourceLength{0};
+    size_t _fillBufferAndCompress(uint8_t* buf, size_t maxLen);
+    // send the headers on their own, when no content goes with them
+    size_t _writeHead(AsyncWebServerRequest* request);
 
   protected:
     AwsTemplateProcessor _callback;
+    // when set, content is produced from the compiled template instead of scanning the source for placeholders
+    std::shared_ptr<const AsyncCompiledTemplate> _template;
 
   public:
     AsyncAbstractResponse(AwsTemplateProcessor callback = nullptr);
-    virtual ~AsyncAbstractResponse() {}
+    virtual ~AsyncAbstractResponse() {
+      free(_tplLookahead);
+      delete _gzip;
+    }
+    bool compress(uint8_t level = ASYNC_GZIP_LEVEL, uint8_t windowBits = ASYNC_GZIP_WINDOW_BITS, size_t maxMemory = ASYNC_GZIP_MAX_MEMORY) override;
     void _respond(AsyncWebServerRequest* request) override final;
     size_t _ack(AsyncWebServerRequest* request, size_t len, uint32_t time) override final;
     virtual bool _sourceValid() const { return false; }
     virtual size_t _fillBuffer(uint8_t* buf __attribute__((unused)), size_t maxLen __attribute__((unused))) { return 0; }
+    // move the source read position, required to stream the literal spans of a compiled template
+    virtual bool _seekContent(size_t pos __attribute__((unused))) { return false; }
+    // called while sent data is in flight, lets the source prepare data for the next buffer
+    virtual void _prefillBuffer() {}
 };
 
-#ifndef TEMPLATE_PLACEHOLDER
-  #define TEMPLATE_PLACEHOLDER '%'
-#endif
-
-#define TEMPLATE_PARAM_NAME_LENGTH 32
 class AsyncFileResponse : public AsyncAbstractResponse {
     using File = fs::File;
     using FS = fs::FS;
@@ -84,6 +198,11 @@ class AsyncFileResponse : public AsyncAbstractResponse {
   private:
     File _content;
     String _path;
+    // file data read ahead while the previous buffer is in flight
+    uint8_t* _readAheadBuf{nullptr};
+    size_t _readAheadSize{0};
+    size_t _readAheadPos{0};
+    size_t _readAheadLen{0};
     void _setContentTypeFromPath(const String& path);
 
   public:
@@ -91,9 +210,35 @@ class AsyncFileResponse : public AsyncAbstractResponse {
     AsyncFileResponse(FS& fs, const String& path, const String& contentType, bool download = false, AwsTemplateProcessor callback = nullptr) : AsyncFileResponse(fs, path, contentType.c_str(), download, callback) {}
     AsyncFileResponse(File content, const String& path, const char* contentType = asyncsrv::empty, bool download = false, AwsTemplateProcessor callback = nullptr);
     AsyncFileResponse(File content, const String& path, const String& contentType, bool download = false, AwsTemplateProcessor callack = nullptr) : AsyncFileResponse(content, path, contentType.c_str(), download, callack) {}
-    ~AsyncFileResponse() { _content.close(); }
+    ~AsyncFileResponse() {
+      _content.close();
+      free(_readAheadBuf);
+    }
+    // a file processed as a template is generated content
+    bool _staticContent() const override { return !_callback; }
+
+    /**
+     * @brief use a compiled template (see AsyncTemplateCache) to process the file instead of scanning it on each request
+     * @note must be called before the response is sent
+     *
+     * @return true if a compiled template is used
+     */
+    bool compileTemplate();
+
+    /**
+     * @brief read up to size bytes of the file ahead, while the previously sent data is in flight,
+     * so that the next buffer does not wait on a file system read when the ack arrives.
+     * Disabled if 0 (default).
+     * @note must be called before the response is sent
+     *
+     * @param size read-ahead buffer size, allocated once for the response
+     */
+    void setReadAhead(size_t size);
+
     bool _sourceValid() const override final { return !!(_content); }
     size_t _fillBuffer(uint8_t* buf, size_t maxLen) override final;
+    bool _seekContent(size_t pos) override final;
+    void _prefillBuffer() override final;
 };
 
 class AsyncStreamResponse : public AsyncAbstractResponse {
@@ -157,4 +302,96 @@ class AsyncResponseStream : public AsyncAbstractResponse, public Print {
     using Print::write;
 };
 
+// chunk queue shared by a chunked response stream and its writers, which may outlive the response
+struct AsyncChunkedStreamState {
+    std::deque<std::vector<uint8_t>> chunks;
+    size_t chunkSize;
+    size_t maxChunks;
+    size_t readPos{0};
+    bool ended{false};
+    bool closed{false}; // the response is gone, nothing written is sent anymore
+#ifdef ESP32
+    std::mutex lock;
+#endif
+
+    AsyncChunkedStreamState(size_t chunkSize, size_t maxChunks) : chunkSize(chunkSize), maxChunks(maxChunks) {}
+    size_t availableForWrite() const;
+};
+
+/**
+ * @brief Handle to write into an AsyncChunkedResponseStream from another task
+ * It shares the chunk queue with the response, so it stays safe to use after the response is deleted
+ * on disconnect: writes are then refused and closed() returns true.
+ */
+class AsyncChunkedStreamWriter : public Print {
+  private:
+    std::shared_ptr<AsyncChunkedStreamState> _st;
+
+  public:
+    AsyncChunkedStreamWriter() {}
+    explicit AsyncChunkedStreamWriter(std::shared_ptr<AsyncChunkedStreamState> state) : _st(std::move(state)) {}
+
+    size_t write(const uint8_t* data, size_t len) override;
+    size_t write(uint8_t data) override { return write(&data, 1); }
+    using Print::write;
+    int availableForWrite() override;
+    // mark the end of the content, see AsyncChunkedResponseStream::end()
+    void end();
+    // whether the response is gone, the writer can stop
+    bool closed() const;
+};
+
+/**
+ * @brief Response stream sending its content while it is written
+ * Writes are queued in a bounded list of chunks and go out with chunked transfer encoding
+ * (or until the connection is closed for HTTP/1.0 clients) as the socket drains the queue.
+ * When the queue is full, write() accepts fewer bytes than given: check availableForWrite(),
+ * or register onWritable() to be called from the network task whenever there is room.
+ * A writer living in another task must use writer() instead of the response, which is deleted when the request ends.
+ */
+class AsyncChunkedResponseStream : public AsyncAbstractResponse, public Print {
+  private:
+    std::shared_ptr<AsyncChunkedStreamState> _st;
+    AsyncChunkedStreamWriter _writer;
+    AwsStreamWritableHandler _onWritable{nullptr};
+
+  public:
+    AsyncChunkedResponseStream(const char* contentType, size_t chunkSize = RESPONSE_STREAM_BUFFER_SIZE, size_t maxChunks = RESPONSE_STREAM_MAX_CHUNKS, bool chunked = true);
+    AsyncChunkedResponseStream(const String& contentType, size_t chunkSize = RESPONSE_STREAM_BUFFER_SIZE, size_t maxChunks = RESPONSE_STREAM_MAX_CHUNKS, bool chunked = true) : AsyncChunkedResponseStream(contentType.c_str(), chunkSize, maxChunks, chunked) {}
+    ~AsyncChunkedResponseStream();
+    bool _sourceValid() const override final { return (_state < RESPONSE_END); }
+    size_t _fillBuffer(uint8_t* buf, size_t maxLen) override final;
+
+    size_t write(const uint8_t* data, size_t len) { return _writer.write(data, len); }
+    size_t write(uint8_t data) { return _writer.write(data); }
+    using Print::write;
+
+    /**
+     * @brief number of bytes write() accepts right now
+     */
+    int availableForWrite() override { return _writer.availableForWrite(); }
+
+    /**
+     * @brief set a callback invoked from the network task when the queue has room, before more content is sent
+     * The callback writes what it can and calls end() when it is done. It runs on every acknowledgement,
+     * so content written there is not limited by the poll interval like writes from another task, see writer().
+     */
+    void onWritable(AwsStreamWritableHandler cb) { _onWritable = cb; }
+
+    /**
+     * @brief handle for a writer in another task, valid after the response is deleted
+     * Written data is sent by the network task: with data in flight on its acknowledgement,
+     * but once the queue has run empty only on the next poll of the connection, up to 500 ms later.
+     * A writer that does not keep the queue filled therefore gets at most one queue (maxChunks * chunkSize) per poll;
+     * use onWritable() when the content can be produced on the network task.
+     */
+    AsyncChunkedStreamWriter writer() const { return _writer; }
+
+    /**
+     * @brief mark the end of the content: the response completes once the queue is drained
+     */
+    void end() { _writer.end(); }
+    bool ended() const;
+};
+
 #endif /* ASYNCWEBSERVERRESPONSEIMPL_H_ */
@@ -338,7 +338,29 @@ AsyncAbstractResponse::AsyncAbstractResponse(AwsTemplateProcessor callback) : _c
   }
 }
 
+bool AsyncAbstractResponse::compress(uint8_t level, uint8_t windowBits, size_t maxMemory) {
+  if (_state != RESPONSE_SETUP || _gzip || getHeader(T_Content_Encoding))
+    return false;
+  AsyncGzipEncoder* gzip = new AsyncGzipEncoder(level, windowBits);
+  if (!gzip->begin(maxMemory)) {
+    // over the memory budget or out of memory, the content goes out uncompressed
+    delete gzip;
+    return false;
+  }
+  _gzip = gzip;
+  // the compressed length is not known in advance, a known content length now only bounds the source
+  _gzipSourceBounded = _sendContentLength;
+  _sendContentLength = false;
+  _chunked = true;
+  addHeader(T_Content_Encoding, T_gzip);
+  addHeader(T_Vary, T_Accept_Encoding, false);
+  return true;
+}
+
 void AsyncAbstractResponse::_respond(AsyncWebServerRequest* request) {
+  // HTTP/1.0 has no chunked encoding, the end of the compressed content is marked by closing the connection
+  if (_gzip && !request->version())
+    _chunked = false;
   addHeader(T_Connection, T_close, false);
   _assembleHead(_head, request->version());
   _state = RESPONSE_HEADERS;
@@ -394,6 +416,7 @@ size_t AsyncAbstractResponse::_ack(AsyncWebServerRequest* request, size_t len, u
       //  take the credit back since we are ignoring this ack and rely on other inflight data
       if (len)
         --_in_flight_credit;
+      _prefillBuffer();
       return 0;
     }
 
@@ -410,11 +433,20 @@ size_t AsyncAbstractResponse::_ack(AsyncWebServerRequest* request, size_t len, u
       outLen = ((_contentLength - _sentLength) > space) ? space : (_contentLength - _sentLength);
     }
 
-    uint8_t* buf = (uint8_t*)malloc(outLen + headLen);
+    AsyncSendBufferPool& pool = AsyncSendBufferPool::Instance();
+    if (headLen && pool.enabled() && headLen + (_chunked ? 9 : 1) > pool.bufferSize()) {
+      // the headers leave no room for content in a pooled buffer, send them on their own
+      return _writeHead(request);
+    }
+
+    size_t bufLen = outLen + headLen;
+    uint8_t* buf = pool.acquire(bufLen);
     if (!buf) {
-      // os_printf("_ack malloc %d failed\n", outLen+headLen);
+      // all send buffers are borrowed (or malloc failed), keep the credit and retry on the next ack or poll,
+      // with nothing in flight that is the next poll, up to 500 ms away
       return 0;
     }
+    outLen = bufLen - headLen;
 
     if (headLen) {
       memcpy(buf, _head.c_str(), _head.length());
@@ -425,10 +457,11 @@ size_t AsyncAbstractResponse::_ack(AsyncWebServerRequest* request, size_t len, u
     if (_chunked) {
       // HTTP 1.1 allows leading zeros in chunk length. Or spaces may be added.
       // See RFC2616 sections 2, 3.6.1.
-      readLen = _fillBufferAndProcessTemplates(buf + headLen + 6, outLen - 8);
+      readLen = _fillBufferAndCompress(buf + headLen + 6, outLen - 8);
       if (readLen == RESPONSE_TRY_AGAIN) {
-        free(buf);
-        return 0;
+        // no content yet, the client still gets the headers
+        pool.release(buf);
+        return _writeHead(request);
       }
       outLen = sprintf((char*)buf + headLen, "%04x", readLen) + headLen;
       buf[outLen++] = '\r';
@@ -437,10 +470,10 @@ size_t AsyncAbstractResponse::_ack(AsyncWebServerRequest* request, size_t len, u
       buf[outLen++] = '\r';
       buf[outLen++] = '\n';
     } else {
-      readLen = _fillBufferAndProcessTemplates(buf + headLen, outLen);
+      readLen = _fillBufferAndCompress(buf + headLen, outLen);
       if (readLen == RESPONSE_TRY_AGAIN) {
-        free(buf);
-        return 0;
+        pool.release(buf);
+        return _writeHead(request);
       }
       outLen = readLen + headLen;
     }
@@ -461,10 +494,13 @@ size_t AsyncAbstractResponse::_ack(AsyncWebServerRequest* request, size_t len, u
       _sentLength += outLen - headLen;
     }
 
-    free(buf);
+    pool.release(buf);
 
-    if ((_chunked && readLen == 0) || (!_sendContentLength && outLen == 0) || (!_chunked && _sentLength == _contentLength)) {
+    if ((_chunked && readLen == 0) || (!_sendContentLength && outLen == 0) || (!_chunked && _sendContentLength && _sentLength == _contentLength)) {
       _state = RESPONSE_WAIT_ACK;
+    } else {
+      // prepare the next buffer while this one is in flight
+      _prefillBuffer();
     }
     return outLen;
 
@@ -478,107 +514,322 @@ size_t AsyncAbstractResponse::_ack(AsyncWebServerRequest* request, size_t len, u
   return 0;
 }
 
-size_t AsyncAbstractResponse::_readDataFromCacheOrContent(uint8_t* data, const size_t len) {
-  // If we have something in cache, copy it to buffer
-  const size_t readFromCache = std::min(len, _cache.size());
-  if (readFromCache) {
-    memcpy(data, _cache.data(), readFromCache);
-    _cache.erase(_cache.begin(), _cache.begin() + readFromCache);
+size_t AsyncAbstractResponse::_writeHead(AsyncWebServerRequest* request) {
+  const size_t headLen = _head.length();
+  if (!headLen)
+    return 0;
+  _writtenLength += request->client()->write(_head.c_str(), headLen);
+  _in_flight += headLen;
+  --_in_flight_credit; // take a credit
+  _head = emptyString;
+  return headLen;
+}
+
+size_t AsyncAbstractResponse::_writeTemplateValue(uint8_t* data, size_t len) {
+  if (_tplValuePos >= _tplValue.length())
+    return 0;
+  const size_t n = std::min(len, (size_t)(_tplValue.length() - _tplValuePos));
+  memcpy(data, _tplValue.c_str() + _tplValuePos, n);
+  _tplValuePos += n;
+  if (_tplValuePos == _tplValue.length()) {
+    // release the value as soon as it is written
+    _tplValue = String();
+    _tplValuePos = 0;
+  }
+  return n;
+}
+
+size_t AsyncAbstractResponse::_fillBufferFromCompiledTemplate(uint8_t* data, size_t len) {
+  const std::vector<AsyncCompiledTemplate::Segment>& segments = _template->segments();
+  size_t out = 0;
+  while (out < len) {
+    // finish the placeholder value that did not fit in the previous buffer
+    const size_t valueLen = _writeTemplateValue(data + out, len - out);
+    if (valueLen) {
+      out += valueLen;
+      continue;
+    }
+
+    if (_tplSegment >= segments.size())
+      break;
+
+    const AsyncCompiledTemplate::Segment& segment = segments[_tplSegment];
+    if (segment.param >= 0) {
+      _tplValue = _callback(_template->names()[segment.param]);
+      _tplValuePos = 0;
+      ++_tplSegment;
+      continue;
+    }
+
+    // literal span: the placeholder text before it is skipped by seeking to the span start
+    if (_tplSegmentPos == 0 && !_seekContent(segment.offset))
+      break;
+    const size_t readLen = _fillBuffer(data + out, std::min(len - out, segment.length - _tplSegmentPos));
+    if (readLen == 0 || readLen == RESPONSE_TRY_AGAIN)
+      break;
+    out += readLen;
+    _tplSegmentPos += readLen;
+    if (_tplSegmentPos == segment.length) {
+      ++_tplSegment;
+      _tplSegmentPos = 0;
+    }
+  }
+  return out;
+}
+
+size_t AsyncAbstractResponse::_readTemplateSource(uint8_t* data, size_t len) {
+  // data pushed back to the look-ahead buffer comes first
+  if (_tplLookaheadPos < _tplLookaheadLen) {
+    const size_t n = std::min(len, _tplLookaheadLen - _tplLookaheadPos);
+    memcpy(data, _tplLookahead + _tplLookaheadPos, n);
+    _tplLookaheadPos += n;
+    return n;
+  }
+  _tplLookaheadPos = 0;
+  _tplLookaheadLen = 0;
+  if (_tplSourceEnd)
+    return 0;
+  const size_t n = _fillBuffer(data, len);
+  if (n == 0)
+    _tplSourceEnd = true;
+  return n;
+}
+
+bool AsyncAbstractResponse::_pushBackTemplateSource(const uint8_t* data, size_t len) {
+  // data was just read from the look-ahead buffer, which is still there
+  if (_tplLookaheadPos) {
+    _tplLookaheadPos -= len;
+    return true;
+  }
+  // data was read from the source, keep room to complete a placeholder name after it
+  const size_t size = len + TEMPLATE_PARAM_NAME_LENGTH + 2;
+  if (_tplLookaheadSize < size) {
+    uint8_t* buf = (uint8_t*)realloc(_tplLookahead, size);
+    if (!buf)
+      return false;
+    _tplLookahead = buf;
+    _tplLookaheadSize = size;
+  }
+  memcpy(_tplLookahead, data, len);
+  _tplLookaheadLen = len;
+  return true;
+}
+
+size_t AsyncAbstractResponse::_readTemplateLookahead(size_t len) {
+  if (_tplLookaheadPos) {
+    memmove(_tplLookahead, _tplLookahead + _tplLookaheadPos, _tplLookaheadLen - _tplLookaheadPos);
+    _tplLookaheadLen -= _tplLookaheadPos;
+    _tplLookaheadPos = 0;
   }
-  // If we need to read more...
-  const size_t needFromFile = len - readFromCache;
-  const size_t readFromContent = _fillBuffer(data + readFromCache, needFromFile);
-  return readFromCache + readFromContent;
+  len = std::min(len, _tplLookaheadSize - _tplLookaheadLen);
+  const size_t n = _fillBuffer(_tplLookahead + _tplLookaheadLen, len);
+  if (n == RESPONSE_TRY_AGAIN)
+    return n;
+  if (n == 0)
+    _tplSourceEnd = true;
+  _tplLookaheadLen += n;
+  return n;
+}
+
+size_t AsyncAbstractResponse::_fillBufferAndCompress(uint8_t* data, size_t len) {
+  if (!_gzip)
+    return _fillBufferAndProcessTemplates(data, len);
+
+  size_t out = 0;
+  while (out < len && !_gzip->done()) {
+    size_t n = _gzip->read(data + out, len - out);
+    out += n;
+    if (n || _gzip->finished())
+      continue;
+    // the encoder needs more input, the content is written straight into its window
+    size_t room;
+    uint8_t* in = _gzip->inputBuffer(room);
+    if (!in)
+      break;
+    if (_gzipSourceBounded && room > _contentLength - _gzipSourceLength)
+      room = _contentLength - _gzipSourceLength;
+    size_t readLen = room ? _fillBufferAndProcessTemplates(in, room) : 0;
+    if (readLen == RESPONSE_TRY_AGAIN)
+      return out ? out : RESPONSE_TRY_AGAIN;
+    if (readLen) {
+      _gzip->commit(readLen);
+      _gzipSourceLength += readLen;
+    } else {
+      _gzip->finish();
+    }
+  }
+  return out;
 }
 
 size_t AsyncAbstractResponse::_fillBufferAndProcessTemplates(uint8_t* data, size_t len) {
   if (!_callback)
     return _fillBuffer(data, len);
 
-  const size_t originalLen = len;
-  len = _readDataFromCacheOrContent(data, len);
-  // Now we've read 'len' bytes, either from cache or from file
-  // Search for template placeholders
-  uint8_t* pTemplateStart = data;
-  while ((pTemplateStart < &data[len]) && (pTemplateStart = (uint8_t*)memchr(pTemplateStart, TEMPLATE_PLACEHOLDER, &data[len - 1] - pTemplateStart + 1))) { // data[0] ... data[len - 1]
-    uint8_t* pTemplateEnd = (pTemplateStart < &data[len - 1]) ? (uint8_t*)memchr(pTemplateStart + 1, TEMPLATE_PLACEHOLDER, &data[len - 1] - pTemplateStart) : nullptr;
-    // temporary buffer to hold parameter name
-    uint8_t buf[TEMPLATE_PARAM_NAME_LENGTH + 1];
-    String paramName;
-    // If closing placeholder is found:
-    if (pTemplateEnd) {
-      // prepare argument to callback
-      const size_t paramNameLength = std::min((size_t)sizeof(buf) - 1, (size_t)(pTemplateEnd - pTemplateStart - 1));
-      if (paramNameLength) {
-        memcpy(buf, pTemplateStart + 1, paramNameLength);
-        buf[paramNameLength] = 0;
-        paramName = String(reinterpret_cast<char*>(buf));
-      } else { // double percent sign encountered, this is single percent sign escaped.
-        // remove the 2nd percent sign
-        memmove(pTemplateEnd, pTemplateEnd + 1, &data[len] - pTemplateEnd - 1);
-        len += _readDataFromCacheOrContent(&data[len - 1], 1) - 1;
-        ++pTemplateStart;
+  if (_template)
+    return _fillBufferFromCompiledTemplate(data, len);
+
+  // a placeholder is at most TEMPLATE_PARAM_NAME_LENGTH characters between two placeholder chars
+  constexpr size_t maxPlaceholderLen = TEMPLATE_PARAM_NAME_LENGTH + 2;
+  size_t out = 0;
+  while (out < len) {
+    // finish the placeholder value that did not fit in the previous buffer
+    const size_t valueLen = _writeTemplateValue(data + out, len - out);
+    if (valueLen) {
+      out += valueLen;
+      continue;
+    }
+
+    // a placeholder candidate is pushed back to the look-ahead buffer, resolve it there
+    if (_tplLookaheadPos < _tplLookaheadLen && _tplLookahead[_tplLookaheadPos] == TEMPLATE_PLACEHOLDER) {
+      const size_t available = _tplLookaheadLen - _tplLookaheadPos;
+      if (available < maxPlaceholderLen && !_tplSourceEnd) {
+        if (_readTemplateLookahead(maxPlaceholderLen - available) == RESPONSE_TRY_AGAIN)
+          return out ? out : RESPONSE_TRY_AGAIN;
+        continue;
+      }
+      const uint8_t* pTemplateStart = _tplLookahead + _tplLookaheadPos;
+      const uint8_t* pTemplateEnd = (const uint8_t*)memchr((void*)(pTemplateStart + 1), TEMPLATE_PLACEHOLDER, std::min(available, maxPlaceholderLen) - 1);
+      if (!pTemplateEnd || pTemplateEnd == pTemplateStart + 1) {
+        // closing placeholder not found, the percent sign is plain text.
+        // Or double percent sign encountered, this is single percent sign escaped.
+        data[out++] = TEMPLATE_PLACEHOLDER;
+        _tplLookaheadPos += pTemplateEnd ? 2 : 1;
+        continue;
       }
-    } else if (&data[len - 1] - pTemplateStart + 1 < TEMPLATE_PARAM_NAME_LENGTH + 2) { // closing placeholder not found, check if it's in the remaining file data
-      memcpy(buf, pTemplateStart + 1, &data[len - 1] - pTemplateStart);
-      const size_t readFromCacheOrContent = _readDataFromCacheOrContent(buf + (&data[len - 1] - pTemplateStart), TEMPLATE_PARAM_NAME_LENGTH + 2 - (&data[len - 1] - pTemplateStart + 1));
-      if (readFromCacheOrContent) {
-        pTemplateEnd = (uint8_t*)memchr(buf + (&data[len - 1] - pTemplateStart), TEMPLATE_PLACEHOLDER, readFromCacheOrContent);
-        if (pTemplateEnd) {
-          // prepare argument to callback
-          *pTemplateEnd = 0;
-          paramName = String(reinterpret_cast<char*>(buf));
-          // Copy remaining read-ahead data into cache
-          _cache.insert(_cache.begin(), pTemplateEnd + 1, buf + (&data[len - 1] - pTemplateStart) + readFromCacheOrContent);
-          pTemplateEnd = &data[len - 1];
-        } else // closing placeholder not found in file data, store found percent symbol as is and advance to the next position
-        {
-          // but first, store read file data in cache
-          _cache.insert(_cache.begin(), buf + (&data[len - 1] - pTemplateStart), buf + (&data[len - 1] - pTemplateStart) + readFromCacheOrContent);
-          ++pTemplateStart;
+      String paramName;
+      paramName.concat((const char*)pTemplateStart + 1, pTemplateEnd - pTemplateStart - 1);
+      _tplLookaheadPos += pTemplateEnd - pTemplateStart + 1;
+      _tplValue = _callback(paramName);
+      _tplValuePos = 0;
+      continue;
+    }
+
+    const size_t readLen = _readTemplateSource(data + out, len - out);
+    if (readLen == RESPONSE_TRY_AGAIN)
+      return out ? out : RESPONSE_TRY_AGAIN;
+    if (readLen == 0)
+      break;
+
+    // everything up to the next placeholder char is plain text, the rest goes back to the look-ahead buffer
+    uint8_t* pTemplateStart = (uint8_t*)memchr(data + out, TEMPLATE_PLACEHOLDER, readLen);
+    if (!pTemplateStart || !_pushBackTemplateSource(pTemplateStart, data + out + readLen - pTemplateStart)) {
+      out += readLen;
+      continue;
+    }
+    out = pTemplateStart - data;
+  }
+  return out;
+}
+
+/*
+ * Compiled Template
+ * */
+
+void AsyncCompiledTemplate::_addLiteral(size_t offset, size_t length) {
+  if (!length)
+    return;
+  // merge with the previous span if it is contiguous
+  if (_segments.size() && _segments.back().param < 0 && _segments.back().offset + _segments.back().length == offset) {
+    _segments.back().length += length;
+    return;
+  }
+  _segments.push_back({offset, length, -1});
+}
+
+void AsyncCompiledTemplate::_addParam(const char* name, size_t length) {
+  String paramName;
+  paramName.concat(name, length);
+  int param = 0;
+  while (param < (int)_names.size() && _names[param] != paramName)
+    ++param;
+  if (param == (int)_names.size())
+    _names.push_back(paramName);
+  _segments.push_back({0, 0, param});
+}
+
+std::shared_ptr<AsyncCompiledTemplate> AsyncCompiledTemplate::compile(fs::File& file) {
+  if (!file || !file.seek(0))
+    return nullptr;
+
+  std::shared_ptr<AsyncCompiledTemplate> tpl = std::make_shared<AsyncCompiledTemplate>();
+  if (!tpl)
+    return nullptr;
+
+  uint8_t buf[128];
+  char name[TEMPLATE_PARAM_NAME_LENGTH];
+  size_t nameLen = 0;
+  bool inName = false;
+  size_t literalStart = 0;
+  size_t placeholderStart = 0;
+  size_t offset = 0;
+  size_t readLen;
+
+  while ((readLen = file.read(buf, sizeof(buf))) > 0) {
+    for (size_t i = 0; i < readLen; ++i, ++offset) {
+      if (!inName) {
+        if (buf[i] == TEMPLATE_PLACEHOLDER) {
+          inName = true;
+          nameLen = 0;
+          placeholderStart = offset;
         }
-      } else // closing placeholder not found in content data, store found percent symbol as is and advance to the next position
-        ++pTemplateStart;
-    } else // closing placeholder not found in content data, store found percent symbol as is and advance to the next position
-      ++pTemplateStart;
-    if (paramName.length()) {
-      // call callback and replace with result.
-      // Everything in range [pTemplateStart, pTemplateEnd] can be safely replaced with parameter value.
-      // Data after pTemplateEnd may need to be moved.
-      // The first byte of data after placeholder is located at pTemplateEnd + 1.
-      // It should be located at pTemplateStart + numBytesCopied (to begin right after inserted parameter value).
-      const String paramValue(_callback(paramName));
-      const char* pvstr = paramValue.c_str();
-      const unsigned int pvlen = paramValue.length();
-      const size_t numBytesCopied = std::min(pvlen, static_cast<unsigned int>(&data[originalLen - 1] - pTemplateStart + 1));
-      // make room for param value
-      // 1. move extra data to cache if parameter value is longer than placeholder AND if there is no room to store
-      if ((pTemplateEnd + 1 < pTemplateStart + numBytesCopied) && (originalLen - (pTemplateStart + numBytesCopied - pTemplateEnd - 1) < len)) {
-        _cache.insert(_cache.begin(), &data[originalLen - (pTemplateStart + numBytesCopied - pTemplateEnd - 1)], &data[len]);
-        // 2. parameter value is longer than placeholder text, push the data after placeholder which not saved into cache further to the end
-        memmove(pTemplateStart + numBytesCopied, pTemplateEnd + 1, &data[originalLen] - pTemplateStart - numBytesCopied);
-        len = originalLen; // fix issue with truncated data, not sure if it has any side effects
-      } else if (pTemplateEnd + 1 != pTemplateStart + numBytesCopied)
-        // 2. Either parameter value is shorter than placeholder text OR there is enough free space in buffer to fit.
-        //    Move the entire data after the placeholder
-        memmove(pTemplateStart + numBytesCopied, pTemplateEnd + 1, &data[len] - pTemplateEnd - 1);
-      // 3. replace placeholder with actual value
-      memcpy(pTemplateStart, pvstr, numBytesCopied);
-      // If result is longer than buffer, copy the remainder into cache (this could happen only if placeholder text itself did not fit entirely in buffer)
-      if (numBytesCopied < pvlen) {
-        _cache.insert(_cache.begin(), pvstr + numBytesCopied, pvstr + pvlen);
-      } else if (pTemplateStart + numBytesCopied < pTemplateEnd + 1) { // result is copied fully; if result is shorter than placeholder text...
-        // there is some free room, fill it from cache
-        const size_t roomFreed = pTemplateEnd + 1 - pTemplateStart - numBytesCopied;
-        const size_t totalFreeRoom = originalLen - len + roomFreed;
-        len += _readDataFromCacheOrContent(&data[len - roomFreed], totalFreeRoom) - roomFreed;
-      } else { // result is copied fully; it is longer than placeholder text
-        const size_t roomTaken = pTemplateStart + numBytesCopied - pTemplateEnd - 1;
-        len = std::min(len + roomTaken, originalLen);
+      } else if (buf[i] == TEMPLATE_PLACEHOLDER) {
+        tpl->_addLiteral(literalStart, placeholderStart - literalStart);
+        if (nameLen)
+          tpl->_addParam(name, nameLen);
+        else // double percent sign encountered, this is single percent sign escaped.
+          tpl->_addLiteral(placeholderStart, 1);
+        literalStart = offset + 1;
+        inName = false;
+      } else if (nameLen < sizeof(name)) {
+        name[nameLen++] = buf[i];
+      } else {
+        // too long to be a parameter name, the opening placeholder is plain text
+        inName = false;
+      }
+    }
+  }
+  tpl->_addLiteral(literalStart, offset - literalStart);
+  return tpl;
+}
+
+std::shared_ptr<const AsyncCompiledTemplate> AsyncTemplateCache::get(fs::File& file, const String& path) {
+  // without a modification time, there is no way to know if a cached template is outdated
+  const time_t lastWrite = file.getLastWrite();
+  if (!lastWrite || !TEMPLATE_CACHE_SIZE)
+    return nullptr;
+  const size_t size = file.size();
+
+#ifdef ESP32
+  std::lock_guard<std::mutex> lock(_lock);
+#endif
+  for (auto i = _entries.begin(); i != _entries.end(); ++i) {
+    if (i->path == path) {
+      if (i->lastWrite == lastWrite && i->size == size) {
+        // keep most recently used entries first
+        _entries.splice(_entries.begin(), _entries, i);
+        return i->tpl;
       }
+      _entries.erase(i);
+      break;
     }
-  } // while(pTemplateStart)
-  return len;
+  }
+
+  std::shared_ptr<const AsyncCompiledTemplate> tpl = AsyncCompiledTemplate::compile(file);
+  file.seek(0);
+  if (!tpl)
+    return nullptr;
+
+  _entries.push_front({path, lastWrite, size, tpl});
+  if (_entries.size() > TEMPLATE_CACHE_SIZE)
+    _entries.pop_back();
+  return tpl;
+}
+
+void AsyncTemplateCache::clear() {
+#ifdef ESP32
+  std::lock_guard<std::mutex> lock(_lock);
+#endif
+  _entries.clear();
 }
 
 /*
@@ -700,8 +951,67 @@ AsyncFileResponse::AsyncFileResponse(File content, const String& path, const cha
   addHeader(T_Content_Disposition, buf, false);
 }
 
+bool AsyncFileResponse::compileTemplate() {
+  if (!_callback || !_content || _started())
+    return false;
+  _template = AsyncTemplateCache::Instance().get(_content, _path);
+  return !!_template;
+}
+
+void AsyncFileResponse::setReadAhead(size_t size) {
+  if (_started() || _readAheadBuf)
+    return;
+  _readAheadSize = size;
+}
+
 size_t AsyncFileResponse::_fillBuffer(uint8_t* data, size_t len) {
-  return _content.read(data, len);
+  size_t readLen = 0;
+  if (_readAheadPos < _readAheadLen) {
+    readLen = std::min(len, _readAheadLen - _readAheadPos);
+    memcpy(data, _readAheadBuf + _readAheadPos, readLen);
+    _readAheadPos += readLen;
+  }
+  if (readLen < len)
+    readLen += _content.read(data + readLen, len - readLen);
+  return readLen;
+}
+
+bool AsyncFileResponse::_seekContent(size_t pos) {
+  if (_readAheadLen) {
+    // the file position is right after the read-ahead data
+    const size_t end = _content.position();
+    const size_t start = end - _readAheadLen;
+    if (pos >= start && pos <= end) {
+      _readAheadPos = pos - start;
+      return true;
+    }
+    _readAheadPos = 0;
+    _readAheadLen = 0;
+  }
+  return _content.seek(pos);
+}
+
+void AsyncFileResponse::_prefillBuffer() {
+  if (!_readAheadSize || !_content)
+    return;
+
+  if (!_readAheadBuf) {
+    _readAheadBuf = (uint8_t*)malloc(_readAheadSize);
+    if (!_readAheadBuf) {
+      // no memory, keep reading the file synchronously
+      _readAheadSize = 0;
+      return;
+    }
+  }
+
+  // keep the unread data and top up the buffer
+  if (_readAheadPos) {
+    memmove(_readAheadBuf, _readAheadBuf + _readAheadPos, _readAheadLen - _readAheadPos);
+    _readAheadLen -= _readAheadPos;
+    _readAheadPos = 0;
+  }
+  if (_readAheadLen < _readAheadSize)
+    _readAheadLen += _content.read(_readAheadBuf + _readAheadLen, _readAheadSize - _readAheadLen);
 }
 
 /*
@@ -818,3 +1128,123 @@ size_t AsyncResponseStream::write(const uint8_t* data, size_t len) {
 size_t AsyncResponseStream::write(uint8_t data) {
   return write(&data, 1);
 }
+
+/*
+ * Chunked Response Stream (content is sent while it is written, through a bounded queue of chunks)
+ * */
+
+size_t AsyncChunkedStreamState::availableForWrite() const {
+  if (ended || closed)
+    return 0;
+  if (chunks.empty())
+    return maxChunks * chunkSize;
+  return (chunkSize - chunks.back().size()) + (maxChunks - chunks.size()) * chunkSize;
+}
+
+size_t AsyncChunkedStreamWriter::write(const uint8_t* data, size_t len) {
+  if (!_st)
+    return 0;
+#ifdef ESP32
+  std::lock_guard<std::mutex> lock(_st->lock);
+#endif
+  if (_st->ended || _st->closed)
+    return 0;
+
+  size_t written = 0;
+  while (written < len) {
+    if (_st->chunks.empty() || _st->chunks.back().size() == _st->chunkSize) {
+      if (_st->chunks.size() == _st->maxChunks)
+        break;
+      _st->chunks.emplace_back();
+      _st->chunks.back().reserve(_st->chunkSize);
+    }
+    std::vector<uint8_t>& chunk = _st->chunks.back();
+    size_t n = std::min(len - written, _st->chunkSize - chunk.size());
+    chunk.insert(chunk.end(), data + written, data + written + n);
+    written += n;
+  }
+  return written;
+}
+
+int AsyncChunkedStreamWriter::availableForWrite() {
+  if (!_st)
+    return 0;
+#ifdef ESP32
+  std::lock_guard<std::mutex> lock(_st->lock);
+#endif
+  return _st->availableForWrite();
+}
+
+void AsyncChunkedStreamWriter::end() {
+  if (!_st)
+    return;
+#ifdef ESP32
+  std::lock_guard<std::mutex> lock(_st->lock);
+#endif
+  _st->ended = true;
+}
+
+bool AsyncChunkedStreamWriter::closed() const {
+  if (!_st)
+    return true;
+#ifdef ESP32
+  std::lock_guard<std::mutex> lock(_st->lock);
+#endif
+  return _st->closed;
+}
+
+AsyncChunkedResponseStream::AsyncChunkedResponseStream(const char* contentType, size_t chunkSize, size_t maxChunks, bool chunked)
+    : _st(std::make_shared<AsyncChunkedStreamState>(chunkSize ? chunkSize : RESPONSE_STREAM_BUFFER_SIZE, maxChunks ? maxChunks : 1)), _writer(_st) {
+  _code = 200;
+  _contentLength = 0;
+  _contentType = contentType;
+  _sendContentLength = false;
+  _chunked = chunked;
+}
+
+AsyncChunkedResponseStream::~AsyncChunkedResponseStream() {
+#ifdef ESP32
+  std::lock_guard<std::mutex> lock(_st->lock);
+#endif
+  // writers holding the state stop here, the queued chunks go with the last of them
+  _st->closed = true;
+  _st->chunks.clear();
+}
+
+bool AsyncChunkedResponseStream::ended() const {
+#ifdef ESP32
+  std::lock_guard<std::mutex> lock(_st->lock);
+#endif
+  return _st->ended;
+}
+
+size_t AsyncChunkedResponseStream::_fillBuffer(uint8_t* buf, size_t maxLen) {
+  if (_onWritable && availableForWrite())
+    _onWritable(this);
+
+#ifdef ESP32
+  std::lock_guard<std::mutex> lock(_st->lock);
+#endif
+  size_t filled = 0;
+  while (filled < maxLen && !_st->chunks.empty()) {
+    std::vector<uint8_t>& chunk = _st->chunks.front();
+    size_t n = std::min(maxLen - filled, chunk.size() - _st->readPos);
+    if (!n)
+      break;
+    memcpy(buf + filled, chunk.data() + _st->readPos, n);
+    filled += n;
+    _st->readPos += n;
+    if (_st->readPos == chunk.size()) {
+      _st->readPos = 0;
+      // keep the last chunk allocated for the next writes
+      if (_st->chunks.size() == 1)
+        chunk.clear();
+      else
+        _st->chunks.pop_front();
+    }
+  }
+
+  if (!filled && !_st->ended)
+    return RESPONSE_TRY_AGAIN;
+  return filled;
+}
@@ -196,3 +196,87 @@ void AsyncWebServer::reset() {
     _catchAllHandler->onBody(NULL);
   }
 }
+
+/*
+ * Shared send buffer pool
+ * */
+
+AsyncSendBufferPool::AsyncSendBufferPool() {
+  if (ASYNC_SEND_BUFFER_COUNT)
+    begin(ASYNC_SEND_BUFFER_COUNT, ASYNC_SEND_BUFFER_SIZE);
+}
+
+bool AsyncSendBufferPool::begin(size_t count, size_t size) {
+  if (!end())
+    return false;
+  if (!count || !size)
+    return true;
+
+#ifdef ESP32
+  std::lock_guard<std::mutex> lock(_lock);
+#endif
+  _pool = (uint8_t*)malloc(count * size);
+  if (!_pool) {
+#ifdef ESP32
+    log_e("Failed to allocate send buffer pool");
+#endif
+    return false;
+  }
+  _free.reserve(count);
+  for (size_t i = 0; i < count; i++)
+    _free.push_back(_pool + i * size);
+  _count = count;
+  _size = size;
+  return true;
+}
+
+bool AsyncSendBufferPool::end() {
+#ifdef ESP32
+  std::lock_guard<std::mutex> lock(_lock);
+#endif
+  if (!_pool)
+    return true;
+  if (_free.size() != _count)
+    return false;
+  free(_pool);
+  _pool = nullptr;
+  _free.clear();
+  _free.shrink_to_fit();
+  _count = 0;
+  _size = 0;
+  return true;
+}
+
+uint8_t* AsyncSendBufferPool::acquire(size_t& len) {
+#ifdef ESP32
+  std::lock_guard<std::mutex> lock(_lock);
+#endif
+  if (!_pool)
+    return (uint8_t*)malloc(len);
+  if (_free.empty())
+    return nullptr;
+  uint8_t* buf = _free.back();
+  _free.pop_back();
+  if (len > _size)
+    len = _size;
+  return buf;
+}
+
+void AsyncSendBufferPool::release(uint8_t* buf) {
+  if (!buf)
+    return;
+#ifdef ESP32
+  std::lock_guard<std::mutex> lock(_lock);
+#endif
+  if (_pool && buf >= _pool && buf < _pool + _count * _size)
+    _free.push_back(buf);
+  else
+    free(buf);
+}
+
+size_t AsyncSendBufferPool::available() const {
+#ifdef ESP32
+  std::lock_guard<std::mutex> lock(_lock);
+#endif
+  return _pool ? _free.size() : 0;
+}
@@ -8,6 +8,7 @@ namespace asyncsrv {
   static constexpr const char* T_100_CONTINUE = "100-continue";
   static constexpr const char* T_13 = "13";
   static constexpr const char* T_ACCEPT = "accept";
+  static constexpr const char* T_Accept_Encoding = "accept-encoding";
   static constexpr const char* T_Accept_Ranges = "accept-ranges";
   static constexpr const char* T_app_xform_urlencoded = "application/x-www-form-urlencoded";
   static constexpr const char* T_AUTH = "authorization";
@@ -59,20 +60,27 @@ namespace asyncsrv {
   static constexpr const char* T_nonce = "nonce";
   static constexpr const char* T_none = "none";
   static constexpr const char* T_opaque = "opaque";
+  static constexpr const char* T_q_ = "q=";
   static constexpr const char* T_qop = "qop";
   static constexpr const char* T_realm = "realm";
   static constexpr const char* T_realm__ = "realm=\"";
+  static constexpr const char* T_reset = "reset";
   static constexpr const char* T_response = "response";
   static constexpr const char* T_retry_ = "retry: ";
   static constexpr const char* T_retry_after = "retry-after";
   static constexpr const char* T_nn = "\n\n";
   static constexpr const char* T_rn = "\r\n";
   static constexpr const char* T_rnrn = "\r\n\r\n";
+  static constexpr const char* T_sse_comment = ":\n";
+  static constexpr const char* T_subscribe_ = "subscribe:";
+  static constexpr const char* T_topic = "topic";
   static constexpr const char* T_Transfer_Encoding = "transfer-encoding";
   static constexpr const char* T_TRUE = "true";
+  static constexpr const char* T_unsubscribe_ = "unsubscribe:";
   static constexpr const char* T_UPGRADE = "upgrade";
   static constexpr const char* T_uri = "uri";
   static constexpr const char* T_username = "username";
+  static constexpr const char* T_Vary = "vary";
   static constexpr const char* T_WS = "websocket";
   static constexpr const char* T_WWW_AUTH = "www-authenticate";
 
@@ -115,16 +123,20 @@ namespace asyncsrv {
   static constexpr const char* T__woff2 = ".woff2";
   static constexpr const char* T__xml = ".xml";
   static constexpr const char* T__zip = ".zip";
+  static constexpr const char* T_application_gzip = "application/gzip";
   static constexpr const char* T_application_javascript = "application/javascript";
   static constexpr const char* T_application_json = "application/json";
   static constexpr const char* T_application_msgpack = "application/msgpack";
+  static constexpr const char* T_application_octet_stream = "application/octet-stream";
   static constexpr const char* T_application_pdf = "application/pdf";
   static constexpr const char* T_application_x_gzip = "application/x-gzip";
   static constexpr const char* T_application_zip = "application/zip";
+  static constexpr const char* T_audio_ = "audio/";
   static constexpr const char* T_font_eot = "font/eot";
   static constexpr const char* T_font_ttf = "font/ttf";
   static constexpr const char* T_font_woff = "font/woff";
   static constexpr const char* T_font_woff2 = "font/woff2";
+  static constexpr const char* T_image_ = "image/";
   static constexpr const char* T_image_gif = "image/gif";
   static constexpr const char* T_image_jpeg = "image/jpeg";
   static constexpr const char* T_image_png = "image/png";
@@ -135,6 +147,7 @@ namespace asyncsrv {
   static constexpr const char* T_text_html = "text/html";
   static constexpr const char* T_text_plain = "text/plain";
   static constexpr const char* T_text_xml = "text/xml";
+  static constexpr const char* T_video_ = "video/";
 
   // Responce codes
   static constexpr const char* T_HTTP_CODE_100 = "Continue";